@@ -13,33 +13,88 @@
 #include <set>
 #include <vector>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <chrono>
+#include <array>
+#include <atomic>
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#endif
 
-static std::map<std::string, size_t> attribute_map_double = {
-    {"", 0},
-    {"time", 1},
-    {"scalar", 1},
-    {"position", 3},
-    {"quaternion", 4},
-    {"relative_velocity", 6},
-    {"odometric_velocity", 6},
-    {"joint_rvalue", 1},
-    {"joint_tvalue", 1},
-    {"joint_linear_velocity", 1},
-    {"joint_angular_velocity", 1},
-    {"joint_linear_acceleration", 1},
-    {"joint_angular_acceleration", 1},
-    {"joint_force", 1},
-    {"joint_torque", 1},
-    {"cmd_joint_rvalue", 1},
-    {"cmd_joint_tvalue", 1},
-    {"cmd_joint_linear_velocity", 1},
-    {"cmd_joint_angular_velocity", 1},
-    {"cmd_joint_force", 1},
-    {"cmd_joint_torque", 1},
-    {"joint_position", 3},
-    {"joint_quaternion", 4},
-    {"force", 3},
-    {"torque", 3}};
+/**
+ * Attribute widths of the client library, which sizes the send and receive buffers from it. Custom attributes
+ * declared in the request JSON are registered here.
+ */
+extern std::map<std::string, size_t> attribute_map_double;
+
+/**
+ * Custom attributes registered in attribute_map_double, with the number of connectors running with them. The map
+ * outlives a simulation run until `clear mex`, so a later run may declare an attribute again with another width,
+ * but not while a connector still uses it.
+ */
+static std::map<std::string, size_t> custom_attribute_users;
+
+enum class EEncoding : unsigned char
+{
+    None,
+    Float32,
+    Fixed16
+};
+
+/**
+ * Wire encoding of a custom double attribute: float32 packs two values and 16-bit fixed point four values into
+ * each double slot of the client buffers
+ */
+struct AttributeEncoding
+{
+    EEncoding encoding;
+    double scale;
+    size_t size;
+};
+
+/**
+ * Encoded custom attributes, attribute_map_double holds their packed width
+ */
+static std::map<std::string, AttributeEncoding> attribute_encodings;
+
+/**
+ * Width of a double attribute in the client buffers, 0 for attributes without double slots (uint8, uint16 or
+ * unknown). Looking up with find() keeps unknown names out of attribute_map_double.
+ */
+static size_t get_wire_attribute_size(const std::string &attribute_name)
+{
+    const std::map<std::string, size_t>::const_iterator attribute_size = attribute_map_double.find(attribute_name);
+    return attribute_size != attribute_map_double.end() ? attribute_size->second : 0;
+}
+
+/**
+ * Width of a double attribute on the ports and in the connector buffers, which is the decoded width of encoded
+ * attributes
+ */
+static size_t get_attribute_size(const std::string &attribute_name)
+{
+    const std::map<std::string, AttributeEncoding>::const_iterator attribute_encoding = attribute_encodings.find(attribute_name);
+    return attribute_encoding != attribute_encodings.end() ? attribute_encoding->second.size : get_wire_attribute_size(attribute_name);
+}
 
 static Json::Value string_to_json(const std::string &str)
 {
@@ -60,349 +115,3919 @@ static Json::Value string_to_json(const std::string &str)
     }
 }
 
-class MultiverseConnector : public MultiverseClientJson
+static int get_api_callbacks_output_size(const Json::Value &param_json)
 {
-public:
-    MultiverseConnector(
-        const std::string &in_host = "tcp://127.0.0.1",
-        const std::string &in_server_port = "7000",
-        const std::string &in_client_port = "7593",
-        const std::string &world_name = "world",
-        const std::string &simulation_name = "matlab_connector",
-        const Json::Value &param_json = Json::Value(),
-        const double in_time_step = 0.001)
+    if (param_json.isMember("api_callbacks_output_size"))
     {
-        meta_data["world_name"] = world_name;
-        meta_data["simulation_name"] = simulation_name;
-        meta_data["length_unit"] = "m";
-        meta_data["angle_unit"] = "rad";
-        meta_data["mass_unit"] = "kg";
-        meta_data["time_unit"] = "s";
-        meta_data["handedness"] = "rhs";
-        time_step = in_time_step;
+        return param_json["api_callbacks_output_size"].asInt();
+    }
+    // Without a declared width keep the legacy buffer, but only if callbacks are configured at all
+    return param_json.isMember("api_callbacks") ? 10 * 10000 : 0;
+}
 
-        host = in_host;
-        server_port = in_server_port;
-        client_port = in_client_port;
+/**
+ * 64 bit FNV-1a, stable across runs and platforms. Each field is terminated so that adjacent fields cannot alias.
+ */
+static uint64_t hash_field(const std::string &field, uint64_t hash = 14695981039346656037ULL)
+{
+    for (const char c : field)
+    {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+    }
+    return (hash ^ 0x1F) * 1099511628211ULL;
+}
 
-        if (param_json.isMember("send"))
+/**
+ * Hash of the meta data and the send and receive objects that a request is built from
+ */
+static uint64_t get_schema_hash(const std::map<std::string, std::string> &meta_data, const std::map<std::string, std::set<std::string>> &send_objects, const std::map<std::string, std::set<std::string>> &receive_objects)
+{
+    uint64_t hash = hash_field("meta_data");
+    for (const std::pair<const std::string, std::string> &meta_data_entry : meta_data)
+    {
+        hash = hash_field(meta_data_entry.second, hash_field(meta_data_entry.first, hash));
+    }
+    for (const std::map<std::string, std::set<std::string>> *objects : {&send_objects, &receive_objects})
+    {
+        hash = hash_field(objects == &send_objects ? "send" : "receive", hash);
+        for (const std::pair<const std::string, std::set<std::string>> &object : *objects)
         {
-            for (const std::string &object_name : param_json["send"].getMemberNames())
+            hash = hash_field(object.first, hash);
+            for (const std::string &attribute_name : object.second)
             {
-                send_objects[object_name] = {};
-                for (const Json::Value &attribute_name : param_json["send"][object_name])
-                {
-                    send_objects[object_name].insert(attribute_name.asString());
-                }
+                hash = hash_field(attribute_name, hash);
             }
         }
-        if (param_json.isMember("receive"))
+    }
+    return hash;
+}
+
+static void append_json_string(const char *begin, const char *end, std::string &str)
+{
+    str += '"';
+    for (const char *it = begin; it != end; ++it)
+    {
+        const unsigned char c = static_cast<unsigned char>(*it);
+        if (c == '"' || c == '\\')
         {
-            for (const std::string &object_name : param_json["receive"].getMemberNames())
-            {
-                receive_objects[object_name] = {};
-                for (const Json::Value &attribute_name : param_json["receive"][object_name])
-                {
-                    receive_objects[object_name].insert(attribute_name.asString());
-                }
-            }
+            str += '\\';
+            str += static_cast<char>(c);
         }
-        if (param_json.isMember("api_callbacks"))
+        else if (c < 0x20)
         {
-            api_callbacks = param_json["api_callbacks"];
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            str += escaped;
         }
         else
         {
-            api_callbacks = Json::Value();
+            str += static_cast<char>(c);
         }
     }
+    str += '"';
+}
 
-    ~MultiverseConnector()
+/**
+ * Append the value as compact JSON without allocating beyond the capacity of str, reals keep the 17 significant
+ * digits of the jsoncpp writers. A skipped member is left out of the outermost object.
+ */
+static void append_json(const Json::Value &value, std::string &str, const char *skipped_member = nullptr)
+{
+    switch (value.type())
     {
+    case Json::nullValue:
+        str += "null";
+        break;
+    case Json::intValue:
+        str += std::to_string(value.asLargestInt());
+        break;
+    case Json::uintValue:
+        str += std::to_string(value.asLargestUInt());
+        break;
+    case Json::realValue:
+    {
+        if (!std::isfinite(value.asDouble()))
+        {
+            str += "null";
+            break;
+        }
+        char real[32];
+        const int size = std::snprintf(real, sizeof(real), "%.17g", value.asDouble());
+        str.append(real, size);
+        if (std::strpbrk(real, ".e") == nullptr)
+        {
+            str += ".0";
+        }
+        break;
     }
-
-public:
-    void start()
+    case Json::stringValue:
     {
-        connect();
-        *world_time = 0.0;
-        reset();
-
-        communicate(true);
-        mexPrintf("Send RequestMetaData: %s\n", request_meta_data_str.c_str());
-        mexPrintf("Receive ResponseMetaData: %s\n", response_meta_data_str.c_str());
-        communicate(false);
-        communicate_thread = new std::thread([this]()
-                                             { 
-                                              while (!should_stop)
-                                              {
-                                                const double time_now = get_time_now();
-                                                if (!api_callbacks.empty())
-                                                {
-                                                    request_meta_data_json["api_callbacks"] = api_callbacks;
-                                                    request_meta_data_str = request_meta_data_json.toStyledString();
-                                                    communicate(true);
-                                                }
-                                                communicate(false);
-                                                const double time_diff = get_time_now() - time_now;
-                                                if (time_diff < time_step)
-                                                {
-                                                    std::this_thread::sleep_for(std::chrono::milliseconds(static_cast<int>((time_step - time_diff) * 1000)));
-                                                }
-                                              } });
+        const char *begin = nullptr;
+        const char *end = nullptr;
+        value.getString(&begin, &end);
+        append_json_string(begin, end, str);
+        break;
     }
-
-    void stop()
+    case Json::booleanValue:
+        str += value.asBool() ? "true" : "false";
+        break;
+    case Json::arrayValue:
+        str += '[';
+        for (Json::ArrayIndex i = 0; i < value.size(); i++)
+        {
+            if (i > 0)
+            {
+                str += ',';
+            }
+            append_json(value[i], str);
+        }
+        str += ']';
+        break;
+    case Json::objectValue:
     {
-        if (communicate_thread != nullptr)
+        str += '{';
+        bool is_first = true;
+        for (Json::Value::const_iterator it = value.begin(); it != value.end(); ++it)
         {
-            should_stop = true;
-            communicate_thread->join();
-            delete communicate_thread;
-            communicate_thread = nullptr;
+            const char *end = nullptr;
+            const char *begin = it.memberName(&end);
+            if (skipped_member != nullptr && std::strlen(skipped_member) == static_cast<size_t>(end - begin) && std::strncmp(skipped_member, begin, end - begin) == 0)
+            {
+                continue;
+            }
+            if (!is_first)
+            {
+                str += ',';
+            }
+            is_first = false;
+            append_json_string(begin, end, str);
+            str += ':';
+            append_json(*it, str);
         }
+        str += '}';
+        break;
     }
+    }
+}
 
-    void set_sim_time(const double time)
+/**
+ * The static portion of handshake requests by schema hash, shared by the connectors of the process. It outlives a
+ * simulation run until `clear mex`, so the first handshake of a later run or of another block with the same schema
+ * reuses the request too.
+ */
+class RequestSchemaCache
+{
+public:
+    static RequestSchemaCache &get_instance()
     {
-        sim_time = time;
+        static RequestSchemaCache instance;
+        return instance;
     }
 
-    double get_world_time() const
+    bool find(const uint64_t schema_hash, Json::Value &schema_json, std::string &schema_str)
     {
-        return *world_time;
+        std::lock_guard<std::mutex> lock(mutex);
+        const std::map<uint64_t, Entry>::const_iterator entry = entries.find(schema_hash);
+        if (entry == entries.end())
+        {
+            return false;
+        }
+        schema_json = entry->second.schema_json;
+        schema_str = entry->second.schema_str;
+        return true;
     }
 
-    size_t get_send_data_size() const
+    void insert(const uint64_t schema_hash, const Json::Value &schema_json, const std::string &schema_str)
     {
-        return send_buffer.buffer_double.size;
+        std::lock_guard<std::mutex> lock(mutex);
+        // Schemas that change on every handshake, e.g. with object patterns, must not grow the cache without bound
+        if (entries.size() >= max_entries)
+        {
+            entries.clear();
+        }
+        entries[schema_hash] = {schema_json, schema_str};
     }
 
-    size_t get_receive_data_size() const
+private:
+    struct Entry
     {
-        return receive_buffer.buffer_double.size;
-    }
+        Json::Value schema_json;
+        std::string schema_str;
+    };
 
-    void set_send_data_at(size_t index, double value)
+    std::mutex mutex;
+
+    std::map<uint64_t, Entry> entries;
+
+    const size_t max_entries = 64;
+};
+
+static bool is_number_boundary(const char c)
+{
+    return !std::isalnum(static_cast<unsigned char>(c)) && c != '_' && c != '.';
+}
+
+static size_t decode_numbers(const std::string &str, double *data, const size_t size, size_t index)
+{
+    const char *begin = str.c_str();
+    const char *it = begin;
+    while (*it != '\0' && index < size)
     {
-        if (index < send_buffer.buffer_double.size)
-        {
-            send_buffer.buffer_double.data[index] = value;
-        }
-        else
+        const bool is_number_start = std::isdigit(static_cast<unsigned char>(*it)) || *it == '-' || *it == '+' || *it == '.';
+        if (is_number_start && (it == begin || is_number_boundary(*(it - 1))))
         {
-            mexPrintf("Index out of bounds for send data: %zu\n", index);
+            char *end = nullptr;
+            const double value = std::strtod(it, &end);
+            if (end != it && is_number_boundary(*end))
+            {
+                data[index++] = value;
+                it = end;
+                continue;
+            }
         }
+        ++it;
     }
+    return index;
+}
 
-    void set_api_callbacks(const Json::Value &in_api_callbacks)
+static size_t decode_numbers(const Json::Value &value, double *data, const size_t size, size_t index = 0)
+{
+    if (value.isNumeric() || value.isBool())
     {
-        // mexPrintf("Set API callbacks: %s\n", in_api_callbacks.toStyledString().c_str());
-        api_callbacks = in_api_callbacks;
+        if (index < size)
+        {
+            data[index++] = value.asDouble();
+        }
     }
-
-    Json::Value get_api_callbacks_response() const
+    else if (value.isString())
     {
-        return api_callbacks_response;
+        index = decode_numbers(value.asString(), data, size, index);
     }
-
-    double get_receive_data_at(size_t index) const
+    else if (value.isArray() || value.isObject())
     {
-        if (index < receive_buffer.buffer_double.size)
-        {
-            return receive_buffer.buffer_double.data[index];
-        }
-        else
+        for (const Json::Value &element : value)
         {
-            mexPrintf("Index out of bounds for receive data: %zu\n", index);
-            return 0.0;
+            index = decode_numbers(element, data, size, index);
         }
     }
+    return index;
+}
 
-    std::map<std::string, std::map<std::string, std::vector<double *>>> get_send_objects_data() const
+static bool get_api_callbacks_output_shape(const Json::Value &shape_json, std::vector<int> &shape)
+{
+    shape.clear();
+    Json::Value dims = shape_json;
+    if (!dims.isArray())
     {
-        return send_objects_data;
+        dims = Json::Value(Json::arrayValue);
+        dims.append(shape_json);
     }
-
-    std::map<std::string, std::map<std::string, std::vector<double *>>> get_receive_objects_data() const
+    if (dims.size() < 1 || dims.size() > 2)
     {
-        return receive_objects_data;
+        return false;
     }
-
-private:
-    void start_connect_to_server_thread() override
+    for (const Json::Value &dim : dims)
     {
-        connect_to_server();
+        if (!dim.isIntegral() || dim.asInt() <= 0)
+        {
+            return false;
+        }
+        shape.push_back(dim.asInt());
     }
+    return true;
+}
 
-    void wait_for_connect_to_server_thread_finish() override
-    {
-    }
+/**
+ * An attribute declared in the request JSON under "attributes", with its data type and shape
+ */
+struct DeclaredAttribute
+{
+    std::string data_type;
+    std::vector<int> shape;
+    size_t size;
+    EEncoding encoding = EEncoding::None;
+    double scale = 0.0;
+    size_t wire_size;
+};
 
-    void start_meta_data_thread() override
+/**
+ * Whether attribute_map_double and attribute_encodings hold the width and encoding of the declared double attribute
+ */
+static bool is_registered_as(const std::string &attribute_name, const DeclaredAttribute &attribute)
+{
+    if (get_wire_attribute_size(attribute_name) != attribute.wire_size)
     {
-        send_and_receive_meta_data();
+        return false;
     }
-
-    void wait_for_meta_data_thread_finish() override
+    const std::map<std::string, AttributeEncoding>::const_iterator attribute_encoding = attribute_encodings.find(attribute_name);
+    if (attribute_encoding == attribute_encodings.end())
     {
+        return attribute.encoding == EEncoding::None;
     }
+    return attribute_encoding->second.encoding == attribute.encoding && attribute_encoding->second.scale == attribute.scale && attribute_encoding->second.size == attribute.size;
+}
 
-    bool init_objects(bool) override
+/**
+ * A receive attribute with a non-double data type, exposed on its own output port
+ */
+struct TypedPort
+{
+    std::string object_name;
+    std::string attribute_name;
+    DeclaredAttribute attribute;
+};
+
+static bool get_declared_attributes(const Json::Value &param_json, std::map<std::string, DeclaredAttribute> &declared_attributes, std::string &error_message)
+{
+    declared_attributes.clear();
+    if (!param_json.isMember("attributes"))
     {
         return true;
     }
-
-    void bind_request_meta_data() override
+    for (const std::string &attribute_name : param_json["attributes"].getMemberNames())
     {
-        // Create JSON object and populate it
-        if (!request_meta_data_json.isMember("api_callbacks"))
+        const Json::Value &attribute_json = param_json["attributes"][attribute_name];
+        DeclaredAttribute attribute;
+        attribute.data_type = attribute_json.get("data_type", "double").asString();
+        if (attribute.data_type != "double" && attribute.data_type != "uint8" && attribute.data_type != "uint16")
         {
-            request_meta_data_json.clear();
+            error_message = "Attribute: " + attribute_name + " must declare data_type double, uint8 or uint16.";
+            return false;
         }
-
-        request_meta_data_json["meta_data"]["world_name"] = meta_data["world_name"];
-        request_meta_data_json["meta_data"]["simulation_name"] = meta_data["simulation_name"];
-        request_meta_data_json["meta_data"]["length_unit"] = meta_data["length_unit"];
-        request_meta_data_json["meta_data"]["angle_unit"] = meta_data["angle_unit"];
-        request_meta_data_json["meta_data"]["mass_unit"] = meta_data["mass_unit"];
-        request_meta_data_json["meta_data"]["time_unit"] = meta_data["time_unit"];
-        request_meta_data_json["meta_data"]["handedness"] = meta_data["handedness"];
-
-        for (const std::pair<const std::string, std::set<std::string>> &send_object : send_objects)
+        attribute.size = 1;
+        Json::Value shape_json = attribute_json["shape"];
+        if (attribute_json.isMember("width"))
         {
-            for (const std::string &attribute_name : send_object.second)
-            {
-                request_meta_data_json["send"][send_object.first].append(attribute_name);
-            }
+            shape_json = Json::Value(Json::arrayValue);
+            shape_json.append(attribute_json["width"]);
         }
-
-        for (const std::pair<const std::string, std::set<std::string>> &receive_object : receive_objects)
+        for (const Json::Value &dim : shape_json)
         {
-            for (const std::string &attribute_name : receive_object.second)
+            if (!dim.isIntegral() || dim.asInt() <= 0)
             {
-                request_meta_data_json["receive"][receive_object.first].append(attribute_name);
+                attribute.shape.clear();
+                break;
             }
+            attribute.shape.push_back(dim.asInt());
+            attribute.size *= dim.asInt();
         }
-
-        request_meta_data_str = request_meta_data_json.toStyledString();
-    }
-
-    void bind_response_meta_data() override
-    {
-        send_objects.clear();
-        for (const std::string &object_name : response_meta_data_json["send"].getMemberNames())
+        if (attribute.shape.empty())
         {
-            send_objects[object_name] = {};
-            for (const std::string &attribute_name : response_meta_data_json["send"][object_name].getMemberNames())
-            {
-                send_objects[object_name].insert(attribute_name);
-            }
+            error_message = "Attribute: " + attribute_name + " must declare a width or a shape of positive integers.";
+            return false;
         }
-
-        receive_objects.clear();
-        for (const std::string &object_name : response_meta_data_json["receive"].getMemberNames())
+        attribute.wire_size = attribute.size;
+        if (attribute_json.isMember("encoding"))
         {
-            receive_objects[object_name] = {};
-            for (const std::string &attribute_name : response_meta_data_json["receive"][object_name].getMemberNames())
+            const Json::Value &encoding_json = attribute_json["encoding"];
+            if (attribute.data_type != "double")
+            {
+                error_message = "Attribute: " + attribute_name + " can only be encoded with data_type double.";
+                return false;
+            }
+            if (encoding_json.isString() && encoding_json.asString() == "float32")
+            {
+                attribute.encoding = EEncoding::Float32;
+                attribute.wire_size = (attribute.size + 1) / 2;
+            }
+            else if (encoding_json.isObject() && encoding_json["fixed16"].isNumeric() && encoding_json["fixed16"].asDouble() > 0.0)
+            {
+                attribute.encoding = EEncoding::Fixed16;
+                attribute.scale = encoding_json["fixed16"].asDouble();
+                attribute.wire_size = (attribute.size + 3) / 4;
+            }
+            else
             {
-                receive_objects[object_name].insert(attribute_name);
+                error_message = "Attribute: " + attribute_name + " must declare encoding \"float32\" or {\"fixed16\": <positive scale>}.";
+                return false;
             }
         }
-
-        if (response_meta_data_json.isMember("api_callbacks_response"))
+        const std::map<std::string, size_t>::const_iterator custom_attribute = custom_attribute_users.find(attribute_name);
+        const bool is_in_use = custom_attribute != custom_attribute_users.end() && custom_attribute->second > 0;
+        const bool is_known = attribute_map_double.find(attribute_name) != attribute_map_double.end();
+        if (attribute.data_type == "double" && is_known && custom_attribute == custom_attribute_users.end() && attribute.encoding != EEncoding::None)
         {
-            api_callbacks_response = response_meta_data_json["api_callbacks_response"];
+            error_message = "Attribute: " + attribute_name + " is a built-in attribute, which the server interprets and cannot be encoded.";
+            return false;
         }
-        else
+        if (attribute.data_type == "double" && is_known && !is_registered_as(attribute_name, attribute) && (custom_attribute == custom_attribute_users.end() || is_in_use))
         {
-            api_callbacks_response = Json::Value();
+            error_message = "Attribute: " + attribute_name + " is already defined with width " + std::to_string(get_attribute_size(attribute_name)) + (is_in_use ? " or another encoding by a running block." : ".");
+            return false;
         }
+        if (attribute.data_type != "double" && is_in_use)
+        {
+            error_message = "Attribute: " + attribute_name + " is used as double by a running block.";
+            return false;
+        }
+        declared_attributes[attribute_name] = attribute;
     }
+    return true;
+}
 
-    void bind_api_callbacks() override
-    {
-    }
-
-    void bind_api_callbacks_response() override
-    {
-    }
-
-    void init_send_and_receive_data() override
+/**
+ * Register the declared double attributes with the client library, they are laid out as contiguous slots like
+ * the built-in ones. Only called from mdlInitializeSizes, the map is left as is while it already holds the width.
+ */
+static void register_custom_attributes(const std::map<std::string, DeclaredAttribute> &declared_attributes)
+{
+    for (const std::pair<const std::string, DeclaredAttribute> &declared_attribute : declared_attributes)
     {
-        double *send_buffer_double = send_buffer.buffer_double.data;
-        for (const std::pair<const std::string, std::set<std::string>> &send_object : send_objects)
+        const DeclaredAttribute &attribute = declared_attribute.second;
+        if (attribute.data_type == "double")
         {
-            send_objects_data[send_object.first] = {};
-            for (const std::string &attribute_name : send_object.second)
+            if (!is_registered_as(declared_attribute.first, attribute))
             {
-                send_objects_data[send_object.first][attribute_name] = {};
-                for (size_t i = 0; i < attribute_map_double[attribute_name]; ++i)
+                attribute_map_double[declared_attribute.first] = attribute.wire_size;
+                if (attribute.encoding == EEncoding::None)
                 {
-                    send_objects_data[send_object.first][attribute_name].emplace_back(send_buffer_double++);
+                    attribute_encodings.erase(declared_attribute.first);
+                }
+                else
+                {
+                    attribute_encodings[declared_attribute.first] = {attribute.encoding, attribute.scale, attribute.size};
                 }
             }
+            custom_attribute_users.emplace(declared_attribute.first, 0);
         }
-
-        double *receive_buffer_double = receive_buffer.buffer_double.data;
-        for (const std::pair<const std::string, std::set<std::string>> &receive_object : receive_objects)
+        else if (custom_attribute_users.erase(declared_attribute.first) != 0)
         {
-            receive_objects_data[receive_object.first] = {};
-            for (const std::string &attribute_name : receive_object.second)
-            {
-                receive_objects_data[receive_object.first][attribute_name] = {};
-                for (size_t i = 0; i < attribute_map_double[attribute_name]; ++i)
+            // Declared as double by an earlier run, it has no double slots now
+            attribute_map_double.erase(declared_attribute.first);
+            attribute_encodings.erase(declared_attribute.first);
+        }
+    }
+}
+
+/**
+ * Check that the declared double attributes still have their width in attribute_map_double. Another block of
+ * the same model may have registered one with another width after this block was initialized.
+ */
+static bool check_custom_attributes(const std::map<std::string, DeclaredAttribute> &declared_attributes, std::string &error_message)
+{
+    for (const std::pair<const std::string, DeclaredAttribute> &declared_attribute : declared_attributes)
+    {
+        if (declared_attribute.second.data_type == "double" && !is_registered_as(declared_attribute.first, declared_attribute.second))
+        {
+            error_message = "Attribute: " + declared_attribute.first + " is declared with width " + std::to_string(declared_attribute.second.size) + ", but another block registered it with width " + std::to_string(get_attribute_size(declared_attribute.first)) + " or another encoding.";
+            return false;
+        }
+    }
+    return true;
+}
+
+static std::vector<TypedPort> get_typed_receive_ports(const Json::Value &param_json, const std::map<std::string, DeclaredAttribute> &declared_attributes)
+{
+    std::vector<TypedPort> typed_ports;
+    for (const std::string &object_name : param_json["receive"].getMemberNames())
+    {
+        std::set<std::string> attribute_names;
+        for (const Json::Value &attribute_name : param_json["receive"][object_name])
+        {
+            attribute_names.insert(attribute_name.asString());
+        }
+        for (const std::string &attribute_name : attribute_names)
+        {
+            std::map<std::string, DeclaredAttribute>::const_iterator attribute = declared_attributes.find(attribute_name);
+            if (attribute != declared_attributes.end() && attribute->second.data_type != "double")
+            {
+                typed_ports.push_back({object_name, attribute_name, attribute->second});
+            }
+        }
+    }
+    return typed_ports;
+}
+
+/**
+ * A contiguous run of wire slots and the port elements they map to
+ */
+struct SlotRun
+{
+    size_t port;
+    size_t slot;
+    size_t size;
+};
+
+/**
+ * An attribute and its wire slots, listed in port order
+ */
+struct OrderedAttribute
+{
+    std::string object_name;
+    std::string attribute_name;
+    size_t slot;
+    size_t size;
+};
+
+/**
+ * Entries of the port order are "object" or "object:attribute", listed attributes come first in the listed order
+ * and the others follow in the default alphabetical order
+ */
+static std::vector<OrderedAttribute> get_ordered_attributes(const std::map<std::string, std::set<std::string>> &objects, const Json::Value &order_json)
+{
+    std::vector<OrderedAttribute> attributes;
+    size_t slot = 0;
+    for (const std::pair<const std::string, std::set<std::string>> &object : objects)
+    {
+        for (const std::string &attribute_name : object.second)
+        {
+            // uint8 and uint16 attributes have no double slots
+            if (attribute_map_double.find(attribute_name) == attribute_map_double.end())
+            {
+                continue;
+            }
+            const size_t attribute_size = get_attribute_size(attribute_name);
+            attributes.push_back({object.first, attribute_name, slot, attribute_size});
+            slot += attribute_size;
+        }
+    }
+
+    std::vector<OrderedAttribute> ordered_attributes;
+    std::vector<bool> is_placed(attributes.size(), false);
+    const auto place = [&](const size_t i)
+    {
+        if (!is_placed[i])
+        {
+            is_placed[i] = true;
+            ordered_attributes.push_back(attributes[i]);
+        }
+    };
+    for (const Json::Value &entry : order_json)
+    {
+        const std::string name = entry.asString();
+        for (size_t i = 0; i < attributes.size(); i++)
+        {
+            if (attributes[i].object_name == name || attributes[i].object_name + ":" + attributes[i].attribute_name == name)
+            {
+                place(i);
+            }
+        }
+    }
+    for (size_t i = 0; i < attributes.size(); i++)
+    {
+        place(i);
+    }
+    return ordered_attributes;
+}
+
+/**
+ * Compile the port order into contiguous runs, empty if the order is the default one
+ */
+static std::vector<SlotRun> get_port_order(const std::map<std::string, std::set<std::string>> &objects, const Json::Value &order_json)
+{
+    std::vector<SlotRun> slot_runs;
+    size_t port = 0;
+    for (const OrderedAttribute &attribute : get_ordered_attributes(objects, order_json))
+    {
+        if (!slot_runs.empty() && slot_runs.back().slot + slot_runs.back().size == attribute.slot)
+        {
+            slot_runs.back().size += attribute.size;
+        }
+        else
+        {
+            slot_runs.push_back({port, attribute.slot, attribute.size});
+        }
+        port += attribute.size;
+    }
+    if (slot_runs.size() <= 1)
+    {
+        slot_runs.clear();
+    }
+    return slot_runs;
+}
+
+static std::map<std::string, std::set<std::string>> get_objects(const Json::Value &objects_json)
+{
+    std::map<std::string, std::set<std::string>> objects;
+    for (const std::string &object_name : objects_json.getMemberNames())
+    {
+        objects[object_name] = {};
+        for (const Json::Value &attribute_name : objects_json[object_name])
+        {
+            objects[object_name].insert(attribute_name.asString());
+        }
+    }
+    return objects;
+}
+
+/**
+ * A Simulink port holding consecutive attributes in port order
+ */
+struct PortGroup
+{
+    std::string name;
+    size_t size;
+};
+
+/**
+ * Split the ports of the "object" and "attribute" port layouts, empty for the default "vector" layout
+ */
+static std::vector<PortGroup> get_port_groups(const std::map<std::string, std::set<std::string>> &objects, const Json::Value &order_json, const std::string &port_layout)
+{
+    std::vector<PortGroup> port_groups;
+    if (port_layout != "object" && port_layout != "attribute")
+    {
+        return port_groups;
+    }
+    std::string object_name;
+    for (const OrderedAttribute &attribute : get_ordered_attributes(objects, order_json))
+    {
+        if (attribute.size == 0)
+        {
+            continue;
+        }
+        if (port_layout == "object" && !port_groups.empty() && attribute.object_name == object_name)
+        {
+            port_groups.back().size += attribute.size;
+            continue;
+        }
+        object_name = attribute.object_name;
+        port_groups.push_back({port_layout == "object" ? object_name : object_name + ":" + attribute.attribute_name, attribute.size});
+    }
+    return port_groups;
+}
+
+static bool is_object_pattern(const std::string &object_name)
+{
+    return object_name.find_first_of("*?") != std::string::npos;
+}
+
+/**
+ * Glob match with * for any sequence and ? for any single character
+ */
+static bool match_object_pattern(const std::string &pattern, const std::string &object_name)
+{
+    size_t p = 0;
+    size_t n = 0;
+    size_t star = std::string::npos;
+    size_t star_n = 0;
+    while (n < object_name.size())
+    {
+        if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == object_name[n]))
+        {
+            ++p;
+            ++n;
+        }
+        else if (p < pattern.size() && pattern[p] == '*')
+        {
+            star = p++;
+            star_n = n;
+        }
+        else if (star != std::string::npos)
+        {
+            p = star + 1;
+            n = ++star_n;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*')
+    {
+        ++p;
+    }
+    return p == pattern.size();
+}
+
+/**
+ * Number of objects a receive entry stands for on the ports, the declared maximum for a pattern
+ */
+static size_t get_receive_object_count(const Json::Value &max_objects_json, const std::string &object_name)
+{
+    return is_object_pattern(object_name) ? max_objects_json.get(object_name, 0).asUInt() : 1;
+}
+
+/**
+ * Map the bound receive objects to the ports, where each pattern holds the slots of up to its maximum number of
+ * matching objects in name order. Explicitly requested objects take precedence over patterns, unmatched objects
+ * and matches beyond the maximum are dropped.
+ */
+static std::vector<SlotRun> get_pattern_runs(const std::map<std::string, std::set<std::string>> &bound_objects, const std::map<std::string, std::set<std::string>> &request_objects, const Json::Value &max_objects_json)
+{
+    std::map<std::pair<std::string, std::string>, size_t> attribute_ports;
+    std::map<std::string, size_t> pattern_ports;
+    std::map<std::string, size_t> pattern_strides;
+    size_t port = 0;
+    for (const std::pair<const std::string, std::set<std::string>> &object : request_objects)
+    {
+        const bool is_pattern = is_object_pattern(object.first);
+        const size_t object_port = port;
+        for (const OrderedAttribute &attribute : get_ordered_attributes({object}, Json::Value()))
+        {
+            attribute_ports[{object.first, attribute.attribute_name}] = port;
+            port += attribute.size;
+        }
+        if (is_pattern)
+        {
+            pattern_ports[object.first] = object_port;
+            pattern_strides[object.first] = port - object_port;
+            port = object_port + (port - object_port) * get_receive_object_count(max_objects_json, object.first);
+        }
+    }
+
+    std::vector<SlotRun> slot_runs;
+    std::map<std::string, size_t> pattern_match_counts;
+    std::map<std::string, size_t> object_match_indices;
+    for (const OrderedAttribute &attribute : get_ordered_attributes(bound_objects, Json::Value()))
+    {
+        std::map<std::pair<std::string, std::string>, size_t>::const_iterator attribute_port = attribute_ports.end();
+        size_t object_port = 0;
+        if (request_objects.count(attribute.object_name) > 0)
+        {
+            attribute_port = attribute_ports.find({attribute.object_name, attribute.attribute_name});
+        }
+        else
+        {
+            for (const std::pair<const std::string, size_t> &pattern_port : pattern_ports)
+            {
+                if (!match_object_pattern(pattern_port.first, attribute.object_name))
+                {
+                    continue;
+                }
+                if (object_match_indices.count(attribute.object_name) == 0)
+                {
+                    object_match_indices[attribute.object_name] = pattern_match_counts[pattern_port.first]++;
+                }
+                const size_t match_index = object_match_indices.at(attribute.object_name);
+                if (match_index < get_receive_object_count(max_objects_json, pattern_port.first))
+                {
+                    attribute_port = attribute_ports.find({pattern_port.first, attribute.attribute_name});
+                    object_port = match_index * pattern_strides.at(pattern_port.first);
+                }
+                break;
+            }
+        }
+        if (attribute_port == attribute_ports.end())
+        {
+            continue;
+        }
+        const size_t attribute_port_index = attribute_port->second + object_port;
+        if (!slot_runs.empty() && slot_runs.back().slot + slot_runs.back().size == attribute.slot && slot_runs.back().port + slot_runs.back().size == attribute_port_index)
+        {
+            slot_runs.back().size += attribute.size;
+        }
+        else
+        {
+            slot_runs.push_back({attribute_port_index, attribute.slot, attribute.size});
+        }
+    }
+    return slot_runs;
+}
+
+/**
+ * A run of contiguous slots of one shard, shard 0 is the connector of the block itself
+ */
+struct ShardRun
+{
+    size_t shard;
+    size_t slot;
+    size_t port;
+    size_t size;
+};
+
+/**
+ * Compile the port order over all objects into runs of the shards, whose slots follow the default order of the
+ * objects assigned to them
+ */
+static std::vector<ShardRun> get_shard_runs(const std::map<std::string, std::set<std::string>> &objects, const Json::Value &order_json, const std::map<std::string, size_t> &object_shards, const size_t shard_count)
+{
+    std::vector<std::map<std::string, std::set<std::string>>> shard_objects(shard_count);
+    for (const std::pair<const std::string, std::set<std::string>> &object : objects)
+    {
+        const std::map<std::string, size_t>::const_iterator object_shard = object_shards.find(object.first);
+        shard_objects[object_shard == object_shards.end() ? 0 : object_shard->second][object.first] = object.second;
+    }
+    std::map<std::string, std::pair<size_t, size_t>> attribute_slots;
+    for (size_t shard = 0; shard < shard_count; shard++)
+    {
+        for (const OrderedAttribute &attribute : get_ordered_attributes(shard_objects[shard], Json::Value()))
+        {
+            attribute_slots[attribute.object_name + ":" + attribute.attribute_name] = {shard, attribute.slot};
+        }
+    }
+
+    std::vector<ShardRun> shard_runs;
+    size_t port = 0;
+    for (const OrderedAttribute &attribute : get_ordered_attributes(objects, order_json))
+    {
+        const std::pair<size_t, size_t> &attribute_slot = attribute_slots.at(attribute.object_name + ":" + attribute.attribute_name);
+        if (!shard_runs.empty() && shard_runs.back().shard == attribute_slot.first && shard_runs.back().slot + shard_runs.back().size == attribute_slot.second)
+        {
+            shard_runs.back().size += attribute.size;
+        }
+        else
+        {
+            shard_runs.push_back({attribute_slot.first, attribute_slot.second, port, attribute.size});
+        }
+        port += attribute.size;
+    }
+    return shard_runs;
+}
+
+/**
+ * Client ports of the running connectors, a block whose ports clash with them is not started
+ */
+static std::set<std::string> client_ports_in_use;
+
+/**
+ * Client ports the connectors of a block bind to: one per batched world, or the client port of the block followed by one per shard
+ */
+static std::vector<std::string> get_block_client_ports(const Json::Value &param_json, const std::string &client_port)
+{
+    std::vector<std::string> client_ports;
+    if (param_json.isMember("worlds"))
+    {
+        for (const Json::Value &world_client_port : param_json["client_ports"])
+        {
+            client_ports.push_back(world_client_port.asString());
+        }
+        return client_ports;
+    }
+    client_ports.push_back(client_port);
+    for (const Json::Value &shard_json : param_json["shards"])
+    {
+        client_ports.push_back(shard_json["client_port"].asString());
+    }
+    return client_ports;
+}
+
+static bool check_shards(const Json::Value &param_json, std::string &error_message)
+{
+    const Json::Value &shards_json = param_json["shards"];
+    if (!shards_json.isArray())
+    {
+        error_message = "shards must be an array.";
+        return false;
+    }
+    if (param_json.isMember("worlds"))
+    {
+        error_message = "shards cannot be combined with batched worlds.";
+        return false;
+    }
+    std::set<std::string> sharded_objects;
+    for (const Json::Value &shard_json : shards_json)
+    {
+        if (!shard_json.isObject() || !shard_json["host"].isString() || !shard_json["server_port"].isString() || !shard_json["client_port"].isString() || !shard_json["objects"].isArray())
+        {
+            error_message = "Each shard must declare a host, a server_port, a client_port and an array of objects.";
+            return false;
+        }
+        for (const Json::Value &object_name : shard_json["objects"])
+        {
+            if (!param_json["send"].isMember(object_name.asString()) && !param_json["receive"].isMember(object_name.asString()))
+            {
+                error_message = "Shard object: " + object_name.asString() + " is neither sent nor received.";
+                return false;
+            }
+            if (!sharded_objects.insert(object_name.asString()).second)
+            {
+                error_message = "Shard object: " + object_name.asString() + " is assigned to more than one shard.";
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static bool check_port_order(const Json::Value &objects_json, const Json::Value &order_json, std::string &error_message)
+{
+    for (const Json::Value &entry : order_json)
+    {
+        const std::string name = entry.asString();
+        const std::string object_name = name.substr(0, name.find(':'));
+        bool is_found = objects_json.isMember(object_name);
+        if (is_found && name.size() > object_name.size())
+        {
+            const std::string attribute_name = name.substr(object_name.size() + 1);
+            is_found = false;
+            for (const Json::Value &object_attribute_name : objects_json[object_name])
+            {
+                is_found |= object_attribute_name.asString() == attribute_name;
+            }
+        }
+        if (!is_found)
+        {
+            error_message = "Port order entry " + name + " is not in the request.";
+            return false;
+        }
+    }
+    return true;
+}
+
+// The kernels below process two doubles per SSE2 instruction, with a scalar loop for the tail
+// (and for targets without SSE2)
+
+static void multiply_add(double *y, const double *x, const double a, const size_t size)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128d a_pd = _mm_set1_pd(a);
+    for (; i + 2 <= size; i += 2)
+    {
+        _mm_storeu_pd(y + i, _mm_add_pd(_mm_loadu_pd(y + i), _mm_mul_pd(_mm_loadu_pd(x + i), a_pd)));
+    }
+#endif
+    for (; i < size; i++)
+    {
+        y[i] += x[i] * a;
+    }
+}
+
+static void multiply(double *y, const double *x, const double *scale, const size_t size)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 2 <= size; i += 2)
+    {
+        _mm_storeu_pd(y + i, _mm_mul_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(scale + i)));
+    }
+#endif
+    for (; i < size; i++)
+    {
+        y[i] = x[i] * scale[i];
+    }
+}
+
+/**
+ * Pack two float32 values into each wire slot, the last slot is zero padded
+ */
+static void encode_float32(const double *x, const size_t size, double *wire)
+{
+    if (size == 0)
+    {
+        return;
+    }
+    wire[(size - 1) / 2] = 0.0;
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 2 <= size; i += 2)
+    {
+        _mm_storel_pd(wire + i / 2, _mm_castps_pd(_mm_cvtpd_ps(_mm_loadu_pd(x + i))));
+    }
+#endif
+    unsigned char *bytes = reinterpret_cast<unsigned char *>(wire);
+    for (; i < size; i++)
+    {
+        const float value = static_cast<float>(x[i]);
+        std::memcpy(bytes + i * sizeof(float), &value, sizeof(float));
+    }
+}
+
+static void decode_float32(const double *wire, const size_t size, double *y)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 2 <= size; i += 2)
+    {
+        _mm_storeu_pd(y + i, _mm_cvtps_pd(_mm_castpd_ps(_mm_load_sd(wire + i / 2))));
+    }
+#endif
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(wire);
+    for (; i < size; i++)
+    {
+        float value;
+        std::memcpy(&value, bytes + i * sizeof(float), sizeof(float));
+        y[i] = value;
+    }
+}
+
+/**
+ * Pack four 16-bit fixed point values (value / scale, rounded and saturated) into each wire slot, the last slot
+ * is zero padded
+ */
+static void encode_fixed16(const double *x, const size_t size, const double scale, double *wire)
+{
+    if (size == 0)
+    {
+        return;
+    }
+    constexpr double fixed_min = -32768.0;
+    constexpr double fixed_max = 32767.0;
+    const double inv_scale = 1.0 / scale;
+    wire[(size - 1) / 4] = 0.0;
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128d inv_scale_pd = _mm_set1_pd(inv_scale);
+    const __m128d fixed_min_pd = _mm_set1_pd(fixed_min);
+    const __m128d fixed_max_pd = _mm_set1_pd(fixed_max);
+    for (; i + 4 <= size; i += 4)
+    {
+        const __m128d lo = _mm_min_pd(_mm_max_pd(_mm_mul_pd(_mm_loadu_pd(x + i), inv_scale_pd), fixed_min_pd), fixed_max_pd);
+        const __m128d hi = _mm_min_pd(_mm_max_pd(_mm_mul_pd(_mm_loadu_pd(x + i + 2), inv_scale_pd), fixed_min_pd), fixed_max_pd);
+        const __m128i fixed = _mm_unpacklo_epi64(_mm_cvtpd_epi32(lo), _mm_cvtpd_epi32(hi));
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(wire + i / 4), _mm_packs_epi32(fixed, fixed));
+    }
+#endif
+    unsigned char *bytes = reinterpret_cast<unsigned char *>(wire);
+    for (; i < size; i++)
+    {
+        const int16_t value = static_cast<int16_t>(std::lrint(std::min(std::max(x[i] * inv_scale, fixed_min), fixed_max)));
+        std::memcpy(bytes + i * sizeof(int16_t), &value, sizeof(int16_t));
+    }
+}
+
+static void decode_fixed16(const double *wire, const size_t size, const double scale, double *y)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128d scale_pd = _mm_set1_pd(scale);
+    for (; i + 4 <= size; i += 4)
+    {
+        const __m128i packed = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(wire + i / 4));
+        const __m128i fixed = _mm_srai_epi32(_mm_unpacklo_epi16(packed, packed), 16);
+        _mm_storeu_pd(y + i, _mm_mul_pd(_mm_cvtepi32_pd(fixed), scale_pd));
+        _mm_storeu_pd(y + i + 2, _mm_mul_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(fixed, 0xEE)), scale_pd));
+    }
+#endif
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(wire);
+    for (; i < size; i++)
+    {
+        int16_t value;
+        std::memcpy(&value, bytes + i * sizeof(int16_t), sizeof(int16_t));
+        y[i] = value * scale;
+    }
+}
+
+/**
+ * A run of slots in the connector layout and where it starts in the client buffer, packed if it is encoded
+ */
+struct CodecRun
+{
+    size_t slot;
+    size_t wire_slot;
+    size_t size;
+    EEncoding encoding;
+    double scale;
+};
+
+/**
+ * Codec runs of the objects in buffer order, empty if none of their attributes is encoded. Unencoded attributes
+ * are merged into runs that are copied as is.
+ */
+static std::vector<CodecRun> get_codec_runs(const std::map<std::string, std::set<std::string>> &objects)
+{
+    std::vector<CodecRun> codec_runs;
+    bool has_encoding = false;
+    size_t slot = 0;
+    size_t wire_slot = 0;
+    for (const std::pair<const std::string, std::set<std::string>> &object : objects)
+    {
+        for (const std::string &attribute_name : object.second)
+        {
+            const size_t attribute_size = get_attribute_size(attribute_name);
+            const std::map<std::string, AttributeEncoding>::const_iterator attribute_encoding = attribute_encodings.find(attribute_name);
+            if (attribute_encoding != attribute_encodings.end())
+            {
+                has_encoding = true;
+                codec_runs.push_back({slot, wire_slot, attribute_size, attribute_encoding->second.encoding, attribute_encoding->second.scale});
+            }
+            else if (!codec_runs.empty() && codec_runs.back().encoding == EEncoding::None && codec_runs.back().slot + codec_runs.back().size == slot)
+            {
+                codec_runs.back().size += attribute_size;
+            }
+            else if (attribute_size > 0)
+            {
+                codec_runs.push_back({slot, wire_slot, attribute_size, EEncoding::None, 0.0});
+            }
+            slot += attribute_size;
+            wire_slot += get_wire_attribute_size(attribute_name);
+        }
+    }
+    if (!has_encoding)
+    {
+        codec_runs.clear();
+    }
+    return codec_runs;
+}
+
+static size_t get_codec_size(const std::vector<CodecRun> &codec_runs)
+{
+    return codec_runs.empty() ? 0 : codec_runs.back().slot + codec_runs.back().size;
+}
+
+static size_t get_codec_wire_size(const CodecRun &codec_run)
+{
+    switch (codec_run.encoding)
+    {
+    case EEncoding::Float32:
+        return (codec_run.size + 1) / 2;
+    case EEncoding::Fixed16:
+        return (codec_run.size + 3) / 4;
+    default:
+        return codec_run.size;
+    }
+}
+
+/**
+ * Pack the data into a client buffer of wire_size slots, runs that do not fit are skipped
+ */
+static void encode_data(const double *data, const std::vector<CodecRun> &codec_runs, double *wire, const size_t wire_size)
+{
+    for (const CodecRun &codec_run : codec_runs)
+    {
+        if (codec_run.wire_slot + get_codec_wire_size(codec_run) > wire_size)
+        {
+            continue;
+        }
+        switch (codec_run.encoding)
+        {
+        case EEncoding::Float32:
+            encode_float32(data + codec_run.slot, codec_run.size, wire + codec_run.wire_slot);
+            break;
+        case EEncoding::Fixed16:
+            encode_fixed16(data + codec_run.slot, codec_run.size, codec_run.scale, wire + codec_run.wire_slot);
+            break;
+        default:
+            std::copy(data + codec_run.slot, data + codec_run.slot + codec_run.size, wire + codec_run.wire_slot);
+            break;
+        }
+    }
+}
+
+static void decode_data(const double *wire, const size_t wire_size, const std::vector<CodecRun> &codec_runs, double *data)
+{
+    for (const CodecRun &codec_run : codec_runs)
+    {
+        if (codec_run.wire_slot + get_codec_wire_size(codec_run) > wire_size)
+        {
+            std::fill(data + codec_run.slot, data + codec_run.slot + codec_run.size, 0.0);
+            continue;
+        }
+        switch (codec_run.encoding)
+        {
+        case EEncoding::Float32:
+            decode_float32(wire + codec_run.wire_slot, codec_run.size, data + codec_run.slot);
+            break;
+        case EEncoding::Fixed16:
+            decode_fixed16(wire + codec_run.wire_slot, codec_run.size, codec_run.scale, data + codec_run.slot);
+            break;
+        default:
+            std::copy(wire + codec_run.wire_slot, wire + codec_run.wire_slot + codec_run.size, data + codec_run.slot);
+            break;
+        }
+    }
+}
+
+/**
+ * Scales from the server units (m, rad, kg, right-handed) to the units of the Simulink model
+ */
+struct UnitConversion
+{
+    double length = 1.0;
+    double angle = 1.0;
+    double mass = 1.0;
+    bool is_left_handed = false;
+
+    bool is_identity() const
+    {
+        return length == 1.0 && angle == 1.0 && mass == 1.0 && !is_left_handed;
+    }
+};
+
+static bool get_unit_scale(const Json::Value &param_json, const std::string &key, const std::string &server_unit, const std::map<std::string, double> &unit_scales, double &scale, std::string &error_message)
+{
+    const std::string unit = param_json.get(key, server_unit).asString();
+    const std::map<std::string, double>::const_iterator unit_scale = unit_scales.find(unit);
+    if (unit_scale == unit_scales.end())
+    {
+        error_message = "Unsupported " + key + " " + unit + ".";
+        return false;
+    }
+    scale = unit_scale->second;
+    return true;
+}
+
+static bool get_unit_conversion(const Json::Value &param_json, UnitConversion &unit_conversion, std::string &error_message)
+{
+    if (!get_unit_scale(param_json, "length_unit", "m", {{"m", 1.0}, {"cm", 100.0}, {"mm", 1000.0}}, unit_conversion.length, error_message) ||
+        !get_unit_scale(param_json, "angle_unit", "rad", {{"rad", 1.0}, {"deg", 180.0 / 3.14159265358979323846}}, unit_conversion.angle, error_message) ||
+        !get_unit_scale(param_json, "mass_unit", "kg", {{"kg", 1.0}, {"g", 1000.0}}, unit_conversion.mass, error_message))
+    {
+        return false;
+    }
+    const std::string handedness = param_json.get("handedness", "rhs").asString();
+    if (handedness != "rhs" && handedness != "lhs")
+    {
+        error_message = "Unsupported handedness " + handedness + ".";
+        return false;
+    }
+    unit_conversion.is_left_handed = handedness == "lhs";
+    return true;
+}
+
+/**
+ * Append the per-slot scales of an attribute. A left-handed frame mirrors the y axis, which negates the y
+ * component of vectors, the x and z components of axial vectors and the x and z parts of (w, x, y, z) quaternions.
+ */
+static void append_unit_scales(const std::string &attribute_name, const UnitConversion &unit_conversion, std::vector<double> &scales)
+{
+    const double flip = unit_conversion.is_left_handed ? -1.0 : 1.0;
+    const double length = unit_conversion.length;
+    const double angle = unit_conversion.angle;
+    const double force = unit_conversion.mass * length;
+    const double torque = force * length;
+    if (attribute_name == "position" || attribute_name == "joint_position")
+    {
+        scales.insert(scales.end(), {length, flip * length, length});
+    }
+    else if (attribute_name == "quaternion" || attribute_name == "joint_quaternion")
+    {
+        scales.insert(scales.end(), {1.0, flip, 1.0, flip});
+    }
+    else if (attribute_name == "relative_velocity" || attribute_name == "odometric_velocity")
+    {
+        scales.insert(scales.end(), {length, flip * length, length, flip * angle, angle, flip * angle});
+    }
+    else if (attribute_name == "force")
+    {
+        scales.insert(scales.end(), {force, flip * force, force});
+    }
+    else if (attribute_name == "torque")
+    {
+        scales.insert(scales.end(), {flip * torque, torque, flip * torque});
+    }
+    else if (attribute_name == "joint_rvalue" || attribute_name == "joint_angular_velocity" || attribute_name == "joint_angular_acceleration" || attribute_name == "cmd_joint_rvalue" || attribute_name == "cmd_joint_angular_velocity")
+    {
+        scales.push_back(angle);
+    }
+    else if (attribute_name == "joint_tvalue" || attribute_name == "joint_linear_velocity" || attribute_name == "joint_linear_acceleration" || attribute_name == "cmd_joint_tvalue" || attribute_name == "cmd_joint_linear_velocity")
+    {
+        scales.push_back(length);
+    }
+    else if (attribute_name == "joint_force" || attribute_name == "cmd_joint_force")
+    {
+        scales.push_back(force);
+    }
+    else if (attribute_name == "joint_torque" || attribute_name == "cmd_joint_torque")
+    {
+        scales.push_back(torque);
+    }
+    else
+    {
+        scales.insert(scales.end(), get_attribute_size(attribute_name), 1.0);
+    }
+}
+
+static std::vector<double> get_unit_scales(const std::map<std::string, std::set<std::string>> &objects, const UnitConversion &unit_conversion)
+{
+    std::vector<double> scales;
+    for (const std::pair<const std::string, std::set<std::string>> &object : objects)
+    {
+        for (const std::string &attribute_name : object.second)
+        {
+            append_unit_scales(attribute_name, unit_conversion, scales);
+        }
+    }
+    return scales;
+}
+
+enum class EPacing
+{
+    None,
+    WallClock,
+    WorldTime
+};
+
+/**
+ * What the receive data holds while the server is unreachable or an exchange is overdue, error stops the
+ * simulation after too many consecutive overdue steps
+ */
+enum class EDegradedPolicy
+{
+    Hold,
+    Zero,
+    Error
+};
+
+enum class EInterpolation : unsigned char
+{
+    ZeroOrderHold,
+    Linear,
+    Hermite
+};
+
+/**
+ * A contiguous run of receive slots sharing the same reconstruction mode, quaternion runs are interpolated with slerp
+ */
+struct InterpolationRun
+{
+    size_t begin;
+    size_t end;
+    EInterpolation interpolation;
+    bool is_quaternion;
+};
+
+static bool get_interpolation(const Json::Value &interpolation_json, EInterpolation &interpolation)
+{
+    static const std::map<std::string, EInterpolation> interpolation_map = {
+        {"zoh", EInterpolation::ZeroOrderHold},
+        {"linear", EInterpolation::Linear},
+        {"hermite", EInterpolation::Hermite}};
+    if (!interpolation_json.isString() || interpolation_map.count(interpolation_json.asString()) == 0)
+    {
+        return false;
+    }
+    interpolation = interpolation_map.at(interpolation_json.asString());
+    return true;
+}
+
+static bool is_quaternion_attribute(const std::string &attribute_name)
+{
+    const std::string quaternion = "quaternion";
+    return attribute_name.size() >= quaternion.size() && attribute_name.compare(attribute_name.size() - quaternion.size(), quaternion.size(), quaternion) == 0;
+}
+
+/**
+ * Spherical linear interpolation of (w, x, y, z) quaternions along the shortest arc,
+ * alpha > 1 extrapolates with constant angular velocity
+ */
+static void slerp(const double *q0, const double *q1, const double alpha, double *q)
+{
+    double dot = q0[0] * q1[0] + q0[1] * q1[1] + q0[2] * q1[2] + q0[3] * q1[3];
+    const double sign = dot < 0.0 ? -1.0 : 1.0;
+    dot = std::min(std::abs(dot), 1.0);
+    double w0 = 1.0 - alpha;
+    double w1 = alpha;
+    const double theta = std::acos(dot);
+    if (theta > 1E-6)
+    {
+        const double sin_theta = std::sin(theta);
+        w0 = std::sin((1.0 - alpha) * theta) / sin_theta;
+        w1 = std::sin(alpha * theta) / sin_theta;
+    }
+    double norm = 0.0;
+    for (size_t i = 0; i < 4; i++)
+    {
+        q[i] = w0 * q0[i] + w1 * sign * q1[i];
+        norm += q[i] * q[i];
+    }
+    norm = std::sqrt(norm);
+    for (size_t i = 0; norm > 0.0 && i < 4; i++)
+    {
+        q[i] /= norm;
+    }
+}
+
+/**
+ * Rotate a (w, x, y, z) quaternion by a world frame angular velocity over the duration h
+ */
+static void integrate_quaternion(const double *q0, const double *angular_velocity, const double h, double *q)
+{
+    const double angular_speed = std::sqrt(angular_velocity[0] * angular_velocity[0] + angular_velocity[1] * angular_velocity[1] + angular_velocity[2] * angular_velocity[2]);
+    const double half_angle = 0.5 * angular_speed * h;
+    if (half_angle < 1E-12)
+    {
+        std::copy(q0, q0 + 4, q);
+        return;
+    }
+    const double s = std::sin(half_angle) / angular_speed;
+    const double dq[4] = {std::cos(half_angle), angular_velocity[0] * s, angular_velocity[1] * s, angular_velocity[2] * s};
+    q[0] = dq[0] * q0[0] - dq[1] * q0[1] - dq[2] * q0[2] - dq[3] * q0[3];
+    q[1] = dq[0] * q0[1] + dq[1] * q0[0] + dq[2] * q0[3] - dq[3] * q0[2];
+    q[2] = dq[0] * q0[2] - dq[1] * q0[3] + dq[2] * q0[0] + dq[3] * q0[1];
+    q[3] = dq[0] * q0[3] + dq[1] * q0[2] - dq[2] * q0[1] + dq[3] * q0[0];
+}
+
+/**
+ * Receive slots of an object whose pose is forward-predicted, npos if the object has no such attribute
+ */
+struct PredictedObject
+{
+    size_t position;
+    size_t quaternion;
+    size_t relative_velocity;
+};
+
+/**
+ * One exchange seen by the clock filter: the wall clock at its midpoint, the offset of world_time from it and the
+ * round trip time
+ */
+struct ClockSample
+{
+    double wall_time;
+    double offset;
+    double delay;
+};
+
+enum class EDiagnostic : size_t
+{
+    RoundTripTime,
+    PredictionHorizon,
+    PredictionError,
+    ClockOffset,
+    ClockDrift,
+    SimTimeOffset,
+    PacingLag,
+    PacingOverrunCount,
+    ResetCount,
+    ResetTurnaround,
+    LoopJitter,
+    MaxLoopJitter,
+    Connected,
+    ReconnectCount,
+    ReceiveMissCount,
+    Size
+};
+
+static const char *diagnostic_names[] = {
+    "round_trip_time",
+    "prediction_horizon",
+    "prediction_error",
+    "clock_offset",
+    "clock_drift",
+    "sim_time_offset",
+    "pacing_lag",
+    "pacing_overrun_count",
+    "reset_count",
+    "reset_turnaround",
+    "loop_jitter",
+    "max_loop_jitter",
+    "connected",
+    "reconnect_count",
+    "receive_miss_count"};
+
+/**
+ * Output port indices, derived from the request JSON
+ */
+struct OutputPorts
+{
+    int api_callbacks_outputs_begin;
+    int typed_receive_begin;
+    int reset_event;
+    int diagnostics;
+    int receive_groups_begin;
+    int size;
+};
+
+static OutputPorts get_output_ports(const size_t api_callbacks_outputs_size, const size_t typed_receive_ports_size, const bool has_reset_event, const bool has_diagnostics, const size_t receive_groups_size)
+{
+    OutputPorts output_ports;
+    output_ports.api_callbacks_outputs_begin = 2;
+    output_ports.typed_receive_begin = output_ports.api_callbacks_outputs_begin + api_callbacks_outputs_size;
+    output_ports.size = output_ports.typed_receive_begin + typed_receive_ports_size;
+    output_ports.reset_event = has_reset_event ? output_ports.size++ : -1;
+    output_ports.diagnostics = has_diagnostics ? output_ports.size++ : -1;
+    output_ports.receive_groups_begin = output_ports.size;
+    output_ports.size += receive_groups_size;
+    return output_ports;
+}
+
+/**
+ * CPU set and real-time priority of a communicate thread, priority 0 keeps the default scheduling
+ */
+struct ThreadScheduling
+{
+    std::vector<int> cpus;
+    int priority = 0;
+};
+
+static ThreadScheduling get_thread_scheduling(const Json::Value &param_json)
+{
+    ThreadScheduling thread_scheduling;
+    for (const Json::Value &cpu : param_json["io_thread_cpus"])
+    {
+        thread_scheduling.cpus.push_back(cpu.asInt());
+    }
+    thread_scheduling.priority = param_json.get("io_thread_priority", 0).asInt();
+    return thread_scheduling;
+}
+
+/**
+ * Apply the scheduling to the calling thread, returns an empty string or what could not be applied
+ */
+static std::string set_current_thread_scheduling(const ThreadScheduling &thread_scheduling)
+{
+    std::string error_message;
+#ifdef _WIN32
+    if (!thread_scheduling.cpus.empty())
+    {
+        DWORD_PTR mask = 0;
+        for (const int cpu : thread_scheduling.cpus)
+        {
+            if (cpu >= 0 && cpu < static_cast<int>(8 * sizeof(DWORD_PTR)))
+            {
+                mask |= static_cast<DWORD_PTR>(1) << cpu;
+            }
+        }
+        if (SetThreadAffinityMask(GetCurrentThread(), mask) == 0)
+        {
+            error_message += "Failed to pin the communicate thread (error " + std::to_string(GetLastError()) + "). ";
+        }
+    }
+    if (thread_scheduling.priority > 0 && !SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL))
+    {
+        error_message += "Failed to raise the communicate thread priority (error " + std::to_string(GetLastError()) + "). ";
+    }
+#elif defined(__linux__)
+    if (!thread_scheduling.cpus.empty())
+    {
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        for (const int cpu : thread_scheduling.cpus)
+        {
+            if (cpu >= 0 && cpu < CPU_SETSIZE)
+            {
+                CPU_SET(cpu, &cpu_set);
+            }
+        }
+        const int error = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+        if (error != 0)
+        {
+            error_message += "Failed to pin the communicate thread (" + std::string(std::strerror(error)) + "). ";
+        }
+    }
+    if (thread_scheduling.priority > 0)
+    {
+        sched_param param;
+        param.sched_priority = thread_scheduling.priority;
+        const int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (error != 0)
+        {
+            error_message += "Failed to set SCHED_FIFO priority " + std::to_string(thread_scheduling.priority) + " (" + std::string(std::strerror(error)) + "). ";
+        }
+    }
+#else
+    if (!thread_scheduling.cpus.empty() || thread_scheduling.priority > 0)
+    {
+        error_message += "Thread affinity and priority are not supported on this platform. ";
+    }
+#endif
+    return error_message;
+}
+
+static bool lock_memory(const void *data, const size_t size)
+{
+#ifdef _WIN32
+    return VirtualLock(const_cast<void *>(data), size) != 0;
+#elif defined(__linux__)
+    return mlock(data, size) == 0;
+#else
+    return false;
+#endif
+}
+
+static void unlock_memory(const void *data, const size_t size)
+{
+#ifdef _WIN32
+    VirtualUnlock(const_cast<void *>(data), size);
+#elif defined(__linux__)
+    munlock(data, size);
+#endif
+}
+
+class MultiverseConnector;
+
+/**
+ * Process-wide communicate thread that serves every connector with a shared I/O thread, earliest deadline first
+ */
+class ConnectorReactor
+{
+public:
+    static ConnectorReactor &get_instance()
+    {
+        static ConnectorReactor instance;
+        return instance;
+    }
+
+    /**
+     * Register the connector, the thread is started with the scheduling of the first connector and the returned
+     * string tells what of it could not be applied
+     */
+    std::string add(MultiverseConnector *connector, const ThreadScheduling &thread_scheduling);
+
+    /**
+     * Wait until the connector is not being served and remove it, the thread stops with the last connector
+     */
+    void remove(MultiverseConnector *connector);
+
+private:
+    struct Entry
+    {
+        MultiverseConnector *connector;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    void run(const ThreadScheduling thread_scheduling, std::promise<std::string> *scheduling_result);
+
+    std::mutex mutex;
+
+    std::condition_variable condition;
+
+    std::vector<Entry> entries;
+
+    MultiverseConnector *serving_connector = nullptr;
+
+    std::thread *thread = nullptr;
+
+    std::atomic<bool> should_stop{false};
+};
+
+class MultiverseConnector : public MultiverseClientJson
+{
+public:
+    MultiverseConnector(
+        const std::string &in_host = "tcp://127.0.0.1",
+        const std::string &in_server_port = "7000",
+        const std::string &in_client_port = "7593",
+        const std::string &world_name = "world",
+        const std::string &simulation_name = "matlab_connector",
+        const Json::Value &param_json = Json::Value(),
+        const double in_time_step = 0.001)
+    {
+        meta_data["world_name"] = world_name;
+        meta_data["simulation_name"] = simulation_name;
+        meta_data["length_unit"] = "m";
+        meta_data["angle_unit"] = "rad";
+        meta_data["mass_unit"] = "kg";
+        meta_data["time_unit"] = "s";
+        meta_data["handedness"] = "rhs";
+        time_step = in_time_step;
+
+        host = in_host;
+        server_port = in_server_port;
+        client_port = in_client_port;
+        client_ports_in_use.insert(client_port);
+
+        if (param_json.isMember("send"))
+        {
+            for (const std::string &object_name : param_json["send"].getMemberNames())
+            {
+                send_objects[object_name] = {};
+                for (const Json::Value &attribute_name : param_json["send"][object_name])
+                {
+                    send_objects[object_name].insert(attribute_name.asString());
+                }
+            }
+        }
+        if (param_json.isMember("receive"))
+        {
+            for (const std::string &object_name : param_json["receive"].getMemberNames())
+            {
+                receive_objects[object_name] = {};
+                for (const Json::Value &attribute_name : param_json["receive"][object_name])
+                {
+                    receive_objects[object_name].insert(attribute_name.asString());
+                }
+            }
+        }
+        if (std::any_of(receive_objects.begin(), receive_objects.end(), [](const std::pair<const std::string, std::set<std::string>> &receive_object)
+                        { return is_object_pattern(receive_object.first); }))
+        {
+            // Patterns are requested through the empty object name of the server, which stands for all objects
+            receive_pattern_objects = receive_objects;
+            receive_pattern_max_objects_json = param_json["receive_pattern_max_objects"];
+            for (const std::pair<const std::string, std::set<std::string>> &receive_object : receive_pattern_objects)
+            {
+                if (is_object_pattern(receive_object.first))
+                {
+                    receive_objects.erase(receive_object.first);
+                    receive_objects[""].insert(receive_object.second.begin(), receive_object.second.end());
+                }
+            }
+            receive_request_objects = receive_objects;
+        }
+        if (param_json.isMember("api_callbacks"))
+        {
+            api_callbacks = param_json["api_callbacks"];
+        }
+        else
+        {
+            api_callbacks = Json::Value();
+        }
+        if (param_json.isMember("api_callbacks_outputs"))
+        {
+            for (const std::string &function_name : param_json["api_callbacks_outputs"].getMemberNames())
+            {
+                std::vector<int> shape;
+                get_api_callbacks_output_shape(param_json["api_callbacks_outputs"][function_name], shape);
+                size_t output_size = 1;
+                for (const int dim : shape)
+                {
+                    output_size *= dim;
+                }
+                api_callbacks_outputs[function_name] = std::vector<double>(output_size, 0.0);
+                api_callbacks_output_shapes[function_name] = shape;
+            }
+        }
+        has_diagnostics = param_json.get("diagnostics", false).asBool();
+        has_clock_sync = param_json.get("clock_sync", false).asBool();
+        const std::string pacing_str = param_json.get("pacing", "").asString();
+        if (pacing_str == "wall_clock")
+        {
+            pacing = EPacing::WallClock;
+        }
+        else if (pacing_str == "world_time")
+        {
+            pacing = EPacing::WorldTime;
+        }
+        else if (!pacing_str.empty())
+        {
+            mexPrintf("Unknown pacing %s, pacing is disabled.\n", pacing_str.c_str());
+        }
+        pacing_spin_time = param_json.get("pacing_spin_time", 0.001).asDouble();
+        is_reset_in_place = param_json.get("reset_in_place", false).asBool();
+        has_shared_io_thread = param_json.get("shared_io_thread", false).asBool();
+        thread_scheduling = get_thread_scheduling(param_json);
+        should_lock_memory = param_json.get("lock_memory", false).asBool();
+        should_reconnect = param_json.get("reconnect", false).asBool();
+        reconnect_max_backoff = param_json.get("reconnect_max_backoff", 5.0).asDouble();
+        const std::string disconnect_policy_str = param_json.get("disconnect_policy", "hold").asString();
+        if (disconnect_policy_str == "zero")
+        {
+            disconnect_policy = EDegradedPolicy::Zero;
+        }
+        else if (disconnect_policy_str != "hold")
+        {
+            mexPrintf("Unknown disconnect policy %s, the last values are held.\n", disconnect_policy_str.c_str());
+        }
+        diagnostics[static_cast<size_t>(EDiagnostic::Connected)] = 1.0;
+        receive_timeout = param_json.get("receive_timeout", 0.0).asDouble();
+        receive_timeout_max_misses = param_json.get("receive_timeout_max_misses", 10).asUInt();
+        const std::string receive_timeout_policy_str = param_json.get("receive_timeout_policy", "hold").asString();
+        if (receive_timeout_policy_str == "zero")
+        {
+            receive_timeout_policy = EDegradedPolicy::Zero;
+        }
+        else if (receive_timeout_policy_str == "error")
+        {
+            receive_timeout_policy = EDegradedPolicy::Error;
+        }
+        else if (receive_timeout_policy_str != "hold")
+        {
+            mexPrintf("Unknown receive timeout policy %s, the last values are held.\n", receive_timeout_policy_str.c_str());
+        }
+        clock_sync_tolerance = param_json.get("clock_sync_tolerance", 0.5).asDouble();
+        std::map<std::string, DeclaredAttribute> declared_attributes;
+        std::string error_message;
+        if (get_declared_attributes(param_json, declared_attributes, error_message))
+        {
+            // Registered by mdlInitializeSizes, the connector only holds them until it is destroyed
+            for (const std::pair<const std::string, DeclaredAttribute> &declared_attribute : declared_attributes)
+            {
+                if (declared_attribute.second.data_type == "double")
+                {
+                    ++custom_attribute_users[declared_attribute.first];
+                    custom_attribute_names.push_back(declared_attribute.first);
+                }
+            }
+            typed_receive_ports = get_typed_receive_ports(param_json, declared_attributes);
+            for (const TypedPort &typed_port : typed_receive_ports)
+            {
+                const size_t element_size = typed_port.attribute.data_type == "uint8" ? sizeof(uint8_t) : sizeof(uint16_t);
+                typed_receive_data.emplace_back(typed_port.attribute.size * element_size, 0);
+            }
+        }
+        get_unit_conversion(param_json, unit_conversion, error_message);
+        send_order_json = param_json["send_order"];
+        receive_order_json = param_json["receive_order"];
+        if (param_json.isMember("shards"))
+        {
+            init_shards(param_json, world_name, simulation_name);
+        }
+        const std::vector<PortGroup> receive_port_groups = get_port_groups(get_objects(param_json["receive"]), receive_order_json, param_json.get("port_layout", "vector").asString());
+        output_ports = ::get_output_ports(api_callbacks_outputs.size(), typed_receive_ports.size(), param_json.get("reset_event", false).asBool(), has_diagnostics, receive_port_groups.size());
+        if (!receive_port_groups.empty() || param_json.isMember("worlds"))
+        {
+            size_t receive_ports_size = 1;
+            for (const OrderedAttribute &attribute : get_ordered_attributes(get_objects(param_json["receive"]), Json::Value()))
+            {
+                receive_ports_size += attribute.size * get_receive_object_count(param_json["receive_pattern_max_objects"], attribute.object_name);
+            }
+            receive_ports_data.assign(receive_ports_size, 0.0);
+        }
+        send_batch_size = param_json.get("send_batch_size", 0).asUInt();
+        send_batch_wait = std::max(0.0, param_json.get("send_batch_wait", 0.0).asDouble());
+        if (param_json.isMember("receive_interpolation"))
+        {
+            receive_interpolation_json = param_json["receive_interpolation"];
+            receive_history_size = std::max(2u, param_json.get("receive_history_size", 4).asUInt());
+        }
+        if (param_json.isMember("receive_prediction"))
+        {
+            receive_prediction_json = param_json["receive_prediction"];
+            receive_prediction_max_horizon = param_json.get("receive_prediction_max_horizon", 0.1).asDouble();
+            receive_history_size = std::max(3u, receive_history_size);
+        }
+        if (param_json.isMember("send_deadband"))
+        {
+            send_deadband_json = param_json["send_deadband"];
+            send_keyframe_interval = param_json.get("send_keyframe_interval", 100).asUInt();
+        }
+    }
+
+    ~MultiverseConnector()
+    {
+        client_ports_in_use.erase(client_port);
+        for (MultiverseConnector *shard : shards)
+        {
+            delete shard;
+        }
+        for (const std::string &custom_attribute_name : custom_attribute_names)
+        {
+            --custom_attribute_users[custom_attribute_name];
+        }
+    }
+
+public:
+    void start()
+    {
+        connect();
+        *world_time = 0.0;
+        reset();
+
+        communicate(true);
+        mexPrintf("Send RequestMetaData: %s\n", request_meta_data_str.c_str());
+        mexPrintf("Receive ResponseMetaData: %s\n", response_meta_data_str.c_str());
+        for (size_t i = 0; i < typed_receive_ports.size(); i++)
+        {
+            if (typed_receive_offsets[i] == typed_receive_no_offset)
+            {
+                mexPrintf("Receive buffer has no %s data for %s:%s, its port stays zero.\n", typed_receive_ports[i].attribute.data_type.c_str(), typed_receive_ports[i].object_name.c_str(), typed_receive_ports[i].attribute_name.c_str());
+            }
+        }
+        communicate(false);
+        reset_count = 0;
+        diagnostics[static_cast<size_t>(EDiagnostic::ResetCount)] = 0.0;
+        std::string scheduling_error;
+        if (has_shared_io_thread)
+        {
+            scheduling_error = ConnectorReactor::get_instance().add(this, thread_scheduling);
+        }
+        else
+        {
+            std::promise<std::string> scheduling_result;
+            std::future<std::string> scheduling_future = scheduling_result.get_future();
+            communicate_thread = new std::thread([this, &scheduling_result]()
+                                                 {
+                                              scheduling_result.set_value(set_current_thread_scheduling(thread_scheduling));
+                                              const std::chrono::steady_clock::duration period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(time_step));
+                                              std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now();
+                                              while (!should_stop)
+                                              {
+                                                tick();
+                                                // Sleeping to an absolute deadline keeps the period from drifting with the tick duration
+                                                deadline = std::max(deadline + period, std::chrono::steady_clock::now());
+                                                std::this_thread::sleep_until(deadline);
+                                              } });
+            scheduling_error = scheduling_future.get();
+        }
+        if (!scheduling_error.empty())
+        {
+            mexPrintf("%sThe communicate thread keeps the default scheduling for these.\n", scheduling_error.c_str());
+        }
+        for (MultiverseConnector *shard : shards)
+        {
+            shard->start();
+        }
+    }
+
+    /**
+     * One iteration of the communicate loop: API callbacks, then the batched or staged send data
+     */
+    void tick()
+    {
+        const double time_now = get_time_now();
+        if (last_tick_time > 0.0)
+        {
+            // Deviation of the loop period from the time step
+            const double jitter = std::abs(time_now - last_tick_time - time_step);
+            std::lock_guard<std::mutex> lock(receive_data_mutex);
+            double &loop_jitter = diagnostics[static_cast<size_t>(EDiagnostic::LoopJitter)];
+            loop_jitter = 0.99 * loop_jitter + 0.01 * jitter;
+            max_loop_jitter = std::max(max_loop_jitter, jitter);
+            diagnostics[static_cast<size_t>(EDiagnostic::MaxLoopJitter)] = max_loop_jitter;
+        }
+        last_tick_time = time_now;
+
+        if (!is_connected)
+        {
+            reconnect();
+            return;
+        }
+        if (!api_callbacks.empty())
+        {
+            request_meta_data_json["api_callbacks"] = api_callbacks;
+            build_request_meta_data_str();
+            communicate_with_deadline(true);
+        }
+        if (send_batch_size > 0)
+        {
+            while (!should_stop && pop_send_batch_sample())
+            {
+                exchange();
+            }
+        }
+        else if (should_exchange())
+        {
+            exchange();
+        }
+    }
+
+    double get_time_step() const
+    {
+        return time_step;
+    }
+
+    void stop()
+    {
+        for (MultiverseConnector *shard : shards)
+        {
+            shard->stop();
+        }
+        should_stop = true;
+        if (has_shared_io_thread)
+        {
+            ConnectorReactor::get_instance().remove(this);
+        }
+        if (communicate_thread != nullptr)
+        {
+            communicate_thread->join();
+            delete communicate_thread;
+            communicate_thread = nullptr;
+        }
+        if (!send_deadband_json.isNull())
+        {
+            mexPrintf("Deadband skipped %zu of %zu exchanges.\n", skipped_exchange_count, skipped_exchange_count + exchange_count);
+        }
+        if (send_batch_overrun_count > 0)
+        {
+            mexPrintf("Send batch overran %zu times, the oldest samples were dropped.\n", send_batch_overrun_count);
+        }
+        if (max_loop_jitter > 0.0)
+        {
+            mexPrintf("Communicate loop jitter: %f s average, %f s maximum.\n", diagnostics[static_cast<size_t>(EDiagnostic::LoopJitter)], max_loop_jitter);
+        }
+        if (receive_miss_count > 0)
+        {
+            mexPrintf("Missed the receive deadline in %zu steps.\n", receive_miss_count);
+        }
+        if (reconnect_count > 0)
+        {
+            mexPrintf("Reconnected %zu times.\n", reconnect_count);
+        }
+        if (lock_memory_failure_count > 0)
+        {
+            mexPrintf("Failed to lock %zu buffers in memory.\n", lock_memory_failure_count);
+        }
+        unlock_buffers();
+        if (pacing_overrun_count > 0)
+        {
+            mexPrintf("Pacing overran %zu times, the maximum lag was %f s.\n", pacing_overrun_count, pacing_max_lag);
+        }
+    }
+
+    /**
+     * Set the time the receive data is evaluated at in mdlOutputs. The clock published to the server as
+     * world_time is only committed with the send data in mdlUpdate.
+     */
+    void set_evaluation_time(const double time)
+    {
+        evaluation_time = time;
+        for (MultiverseConnector *shard : shards)
+        {
+            shard->set_evaluation_time(time);
+        }
+    }
+
+    double get_world_time() const
+    {
+        return *world_time;
+    }
+
+    size_t get_send_data_size() const
+    {
+        return send_data_codec.empty() ? send_buffer.buffer_double.size : get_codec_size(send_data_codec);
+    }
+
+    size_t get_receive_data_size() const
+    {
+        return receive_data_codec.empty() ? receive_buffer.buffer_double.size : get_codec_size(receive_data_codec);
+    }
+
+    void set_send_data_at(size_t index, double value)
+    {
+        std::lock_guard<std::mutex> lock(send_data_mutex);
+        if (index < send_data.size())
+        {
+            send_data[index] = value;
+        }
+        else
+        {
+            mexPrintf("Index out of bounds for send data: %zu\n", index);
+        }
+    }
+
+    /**
+     * Stage the send data with the sim time it belongs to for the next exchange, or append it to the send batch
+     * if batching is enabled. With shards, the values are scattered to the shards first.
+     */
+    void set_send_data(const double time, const double *const *values, const size_t size)
+    {
+        if (has_clock_sync)
+        {
+            double previous_time;
+            {
+                std::lock_guard<std::mutex> lock(send_data_mutex);
+                previous_time = sim_time;
+            }
+            if (time < previous_time && reset_count == reset_count_seen)
+            {
+                mexPrintf("Warning: The clock went back from %f s to %f s, the server will reset the world.\n", previous_time, time);
+            }
+            check_clock_sync();
+        }
+        if (shards.empty())
+        {
+            set_own_send_data(time, values, size);
+            return;
+        }
+        for (const ShardRun &shard_run : shard_send_runs)
+        {
+            if (shard_run.port + shard_run.size <= size)
+            {
+                std::copy(values + shard_run.port, values + shard_run.port + shard_run.size, shard_send_ptrs[shard_run.shard].begin() + shard_run.slot);
+            }
+        }
+        set_own_send_data(time, shard_send_ptrs[0].data(), shard_send_ptrs[0].size());
+        for (size_t i = 0; i < shards.size(); i++)
+        {
+            shards[i]->set_send_data(time, shard_send_ptrs[i + 1].data(), shard_send_ptrs[i + 1].size());
+        }
+    }
+
+    void set_own_send_data(const double time, const double *const *values, const size_t size)
+    {
+        // The clock and the data it belongs to are committed under the same lock, bind_send_data never sees one without the other
+        std::unique_lock<std::mutex> lock(send_data_mutex);
+        sim_time = time;
+        stage_send_data(values, size);
+        if (send_batch_size > 0 && (send_data_deadband.empty() || has_dirty_send_data))
+        {
+            push_send_batch_sample(lock);
+        }
+    }
+
+    void set_api_callbacks(const Json::Value &in_api_callbacks)
+    {
+        // mexPrintf("Set API callbacks: %s\n", in_api_callbacks.toStyledString().c_str());
+        api_callbacks = in_api_callbacks;
+    }
+
+    Json::Value get_api_callbacks_response()
+    {
+        std::lock_guard<std::mutex> lock(api_callbacks_mutex);
+        return api_callbacks_response;
+    }
+
+    bool has_api_callbacks_output(const std::string &function_name) const
+    {
+        return api_callbacks_outputs.find(function_name) != api_callbacks_outputs.end();
+    }
+
+    /**
+     * Copy the decoded API callback results into the given buffers (one per routed function,
+     * in function name order) if a new response arrived since the last call.
+     */
+    bool read_api_callbacks_outputs(const std::vector<double *> &output_ptrs)
+    {
+        std::lock_guard<std::mutex> lock(api_callbacks_mutex);
+        if (api_callbacks_outputs_read_count == api_callbacks_outputs_count)
+        {
+            return false;
+        }
+        api_callbacks_outputs_read_count = api_callbacks_outputs_count;
+        size_t i = 0;
+        for (const std::pair<const std::string, std::vector<double>> &api_callbacks_output : api_callbacks_outputs)
+        {
+            if (i < output_ptrs.size())
+            {
+                std::copy(api_callbacks_output.second.begin(), api_callbacks_output.second.end(), output_ptrs[i++]);
+            }
+        }
+        return true;
+    }
+
+    double get_receive_data_at(size_t index)
+    {
+        std::lock_guard<std::mutex> lock(receive_data_mutex);
+        if (index + 1 < receive_history_sample_size && receive_history_count > 0)
+        {
+            return get_receive_history_sample(receive_history_count - 1)[index + 1];
+        }
+        else
+        {
+            mexPrintf("Index out of bounds for receive data: %zu\n", index);
+            return 0.0;
+        }
+    }
+
+    /**
+     * With shards, each shard is read in one locked copy and the block output is gathered from the copies. The
+     * world_time is the one of the block's own server.
+     */
+    void get_receive_data(double *data, const size_t size)
+    {
+        if (shards.empty())
+        {
+            get_own_receive_data(data, size);
+            return;
+        }
+        get_own_receive_data(shard_receive_data[0].data(), shard_receive_data[0].size());
+        for (size_t i = 0; i < shards.size(); i++)
+        {
+            shards[i]->get_receive_data(shard_receive_data[i + 1].data(), shard_receive_data[i + 1].size());
+        }
+        if (size == 0)
+        {
+            return;
+        }
+        data[0] = shard_receive_data[0][0];
+        for (const ShardRun &shard_run : shard_receive_runs)
+        {
+            if (1 + shard_run.port + shard_run.size <= size)
+            {
+                const std::vector<double>::const_iterator shard_data = shard_receive_data[shard_run.shard].begin() + 1 + shard_run.slot;
+                std::copy(shard_data, shard_data + shard_run.size, data + 1 + shard_run.port);
+            }
+        }
+        receive_data_snapshot.assign(data, data + size);
+    }
+
+    /**
+     * Write the newest world_time and the receive data evaluated at the sim time. Attributes without a
+     * configured reconstruction mode take the newest received sample, predicted poses override both.
+     */
+    void get_own_receive_data(double *data, const size_t size)
+    {
+        std::lock_guard<std::mutex> lock(receive_data_mutex);
+        if (receive_history_count == 0 || size == 0)
+        {
+            return;
+        }
+        if (!receive_pattern_objects.empty())
+        {
+            // The bound objects vary with the matches, they are evaluated in full and then mapped to the ports
+            receive_pattern_data.resize(receive_history_sample_size);
+            evaluate_receive_data(receive_pattern_data.data(), receive_history_sample_size);
+            data[0] = receive_pattern_data[0];
+            std::fill(data + 1, data + size, 0.0);
+            for (const SlotRun &slot_run : receive_pattern_runs)
+            {
+                // The runs of a new layout are swapped in before the history is resized for it
+                if (1 + slot_run.port + slot_run.size <= size && 1 + slot_run.slot + slot_run.size <= receive_history_sample_size)
+                {
+                    std::copy(receive_pattern_data.begin() + 1 + slot_run.slot, receive_pattern_data.begin() + 1 + slot_run.slot + slot_run.size, data + 1 + slot_run.port);
+                }
+            }
+            receive_data_snapshot.assign(data, data + size);
+            return;
+        }
+        const size_t receive_data_size = std::min(size, receive_history_sample_size);
+        evaluate_receive_data(data, receive_data_size);
+        if (!receive_port_order.empty() && receive_data_size == receive_history_sample_size)
+        {
+            receive_port_data.assign(data + 1, data + receive_data_size);
+            for (const SlotRun &slot_run : receive_port_order)
+            {
+                std::copy(receive_port_data.begin() + slot_run.slot, receive_port_data.begin() + slot_run.slot + slot_run.size, data + 1 + slot_run.port);
+            }
+        }
+        receive_data_snapshot.assign(data, data + receive_data_size);
+    }
+
+    /**
+     * Copy the newest sample and evaluate it at the sim time, in the bound layout. Called with receive_data_mutex held.
+     */
+    void evaluate_receive_data(double *data, const size_t receive_data_size)
+    {
+        const double *newest_sample = get_receive_history_sample(receive_history_count - 1);
+        std::copy(newest_sample, newest_sample + receive_data_size, data);
+        // While disconnected or overdue the newest sample is held as is, or zeroed, instead of extrapolated
+        const bool is_degraded = !is_connected || is_receive_overdue;
+        if ((!is_connected && disconnect_policy == EDegradedPolicy::Zero) || (is_receive_overdue && receive_timeout_policy == EDegradedPolicy::Zero))
+        {
+            std::fill(data + 1, data + receive_data_size, 0.0);
+        }
+        if (!receive_data_interpolation.empty() && !is_degraded)
+        {
+            interpolate_receive_data(data + 1, receive_data_size - 1);
+        }
+        if (!predicted_objects.empty() && !is_degraded)
+        {
+            predict_receive_data(data + 1, receive_data_size - 1);
+        }
+    }
+
+    /**
+     * Write the receive data as evaluated at the last major time step, minor time steps must not see it change
+     */
+    void get_receive_data_snapshot(double *data, const size_t size) const
+    {
+        std::copy(receive_data_snapshot.begin(), receive_data_snapshot.begin() + std::min(size, receive_data_snapshot.size()), data);
+    }
+
+    /**
+     * True once for each major time step following one or more world resets. Pacing is rebased on a reset.
+     */
+    bool has_reset_event()
+    {
+        const size_t count = reset_count;
+        if (count == reset_count_seen)
+        {
+            return false;
+        }
+        reset_count_seen = count;
+        has_pacing_start = false;
+        return true;
+    }
+
+    /**
+     * Block until the wall clock, or the world_time extrapolated from the newest received sample, catches up with
+     * the given Simulink time. The absolute deadline is slept towards and the last pacing_spin_time is spun.
+     */
+    void pace(const double time)
+    {
+        if (pacing == EPacing::None)
+        {
+            return;
+        }
+        const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (!has_pacing_start || time < pacing_start_sim_time)
+        {
+            pacing_start = now;
+            pacing_start_sim_time = time;
+            has_pacing_start = true;
+            return;
+        }
+
+        std::chrono::steady_clock::time_point deadline = pacing_start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(time - pacing_start_sim_time));
+        if (pacing == EPacing::WorldTime)
+        {
+            std::lock_guard<std::mutex> lock(receive_data_mutex);
+            if (receive_history_count == 0)
+            {
+                return;
+            }
+            const double world_time_now = get_receive_history_sample(receive_history_count - 1)[0] + get_time_now() - receive_wall_time;
+            deadline = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(time - world_time_now));
+        }
+
+        const double lag = std::chrono::duration<double>(now - deadline).count();
+        if (lag > 0.0)
+        {
+            ++pacing_overrun_count;
+            pacing_max_lag = std::max(pacing_max_lag, lag);
+        }
+        else
+        {
+            const std::chrono::steady_clock::time_point spin_begin = deadline - std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(pacing_spin_time));
+            if (now < spin_begin)
+            {
+                std::this_thread::sleep_until(spin_begin);
+            }
+            while (std::chrono::steady_clock::now() < deadline)
+            {
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(receive_data_mutex);
+        diagnostics[static_cast<size_t>(EDiagnostic::PacingLag)] = lag;
+        diagnostics[static_cast<size_t>(EDiagnostic::PacingOverrunCount)] = pacing_overrun_count;
+    }
+
+    /**
+     * Count a miss for each major time step during which the exchange in flight is older than receive_timeout,
+     * the receive data then degrades by the receive timeout policy. False once the error policy saw
+     * receive_timeout_max_misses consecutive misses, here or on a shard.
+     */
+    bool check_receive_deadline()
+    {
+        bool is_within_deadline = true;
+        for (MultiverseConnector *shard : shards)
+        {
+            is_within_deadline = shard->check_receive_deadline() && is_within_deadline;
+        }
+        if (receive_timeout <= 0.0)
+        {
+            return is_within_deadline;
+        }
+        const double start_time = exchange_start_time;
+        is_receive_overdue = start_time > 0.0 && get_time_now() - start_time > receive_timeout;
+        if (!is_receive_overdue)
+        {
+            consecutive_receive_miss_count = 0;
+            return is_within_deadline;
+        }
+        ++consecutive_receive_miss_count;
+        std::lock_guard<std::mutex> lock(receive_data_mutex);
+        diagnostics[static_cast<size_t>(EDiagnostic::ReceiveMissCount)] = static_cast<double>(++receive_miss_count);
+        return is_within_deadline && (receive_timeout_policy != EDegradedPolicy::Error || consecutive_receive_miss_count < receive_timeout_max_misses);
+    }
+
+    size_t get_typed_receive_ports_size() const
+    {
+        return typed_receive_ports.size();
+    }
+
+    const OutputPorts &get_output_ports() const
+    {
+        return output_ports;
+    }
+
+    /**
+     * Evaluate world_time and the receive data in port order into the buffer the receive group ports, or the
+     * batched output row of this world, are copied from. Minor time steps take the snapshot of the last major time step.
+     */
+    const std::vector<double> &get_receive_ports_data(const bool is_major_time_step)
+    {
+        if (is_major_time_step)
+        {
+            get_receive_data(receive_ports_data.data(), receive_ports_data.size());
+        }
+        else
+        {
+            get_receive_data_snapshot(receive_ports_data.data(), receive_ports_data.size());
+        }
+        return receive_ports_data;
+    }
+
+    /**
+     * The input pointers of the send group ports, or of the batched input row of this world, refilled on each
+     * major time step
+     */
+    std::vector<const double *> &get_send_ports_ptrs()
+    {
+        return send_ports_ptrs;
+    }
+
+    void get_diagnostics(double *data)
+    {
+        std::lock_guard<std::mutex> lock(receive_data_mutex);
+        std::copy(diagnostics.begin(), diagnostics.end(), data);
+    }
+
+    /**
+     * Copy the uint8 or uint16 receive data of a typed port as is, without converting to double
+     */
+    void get_typed_receive_data(const size_t port_index, void *data)
+    {
+        std::lock_guard<std::mutex> lock(receive_data_mutex);
+        if (port_index < typed_receive_data.size())
+        {
+            std::memcpy(data, typed_receive_data[port_index].data(), typed_receive_data[port_index].size());
+        }
+    }
+
+    std::map<std::string, std::map<std::string, std::vector<double *>>> get_send_objects_data() const
+    {
+        return send_objects_data;
+    }
+
+    std::map<std::string, std::map<std::string, std::vector<double *>>> get_receive_objects_data() const
+    {
+        return receive_objects_data;
+    }
+
+private:
+    /**
+     * Create a connector for each shard with the objects assigned to its server, the other objects stay with this
+     * one. Shards only exchange data, API callbacks, pacing, reset events and diagnostics stay with this connector.
+     */
+    void init_shards(const Json::Value &param_json, const std::string &world_name, const std::string &simulation_name)
+    {
+        std::map<std::string, size_t> object_shards;
+        for (Json::ArrayIndex i = 0; i < param_json["shards"].size(); i++)
+        {
+            const Json::Value &shard_json = param_json["shards"][i];
+            Json::Value shard_param_json = param_json;
+            for (const char *member : {"shards", "send_order", "receive_order", "port_layout", "api_callbacks", "api_callbacks_outputs", "reset_event", "pacing"})
+            {
+                shard_param_json.removeMember(member);
+            }
+            shard_param_json["send"] = Json::Value(Json::objectValue);
+            shard_param_json["receive"] = Json::Value(Json::objectValue);
+            for (const Json::Value &object_name_json : shard_json["objects"])
+            {
+                const std::string object_name = object_name_json.asString();
+                object_shards[object_name] = i + 1;
+                if (param_json["send"].isMember(object_name))
+                {
+                    shard_param_json["send"][object_name] = param_json["send"][object_name];
+                    send_objects.erase(object_name);
+                }
+                if (param_json["receive"].isMember(object_name))
+                {
+                    shard_param_json["receive"][object_name] = param_json["receive"][object_name];
+                    receive_objects.erase(object_name);
+                }
+            }
+            shards.push_back(new MultiverseConnector(shard_json["host"].asString(), shard_json["server_port"].asString(), shard_json["client_port"].asString(), world_name, simulation_name, shard_param_json, time_step));
+        }
+
+        // The port order is applied over all shards, not within this connector
+        send_order_json = Json::Value();
+        receive_order_json = Json::Value();
+        shard_send_runs = get_shard_runs(get_objects(param_json["send"]), param_json["send_order"], object_shards, shards.size() + 1);
+        shard_receive_runs = get_shard_runs(get_objects(param_json["receive"]), param_json["receive_order"], object_shards, shards.size() + 1);
+        std::vector<size_t> shard_send_sizes(shards.size() + 1, 0);
+        std::vector<size_t> shard_receive_sizes(shards.size() + 1, 0);
+        for (const ShardRun &shard_run : shard_send_runs)
+        {
+            shard_send_sizes[shard_run.shard] += shard_run.size;
+        }
+        for (const ShardRun &shard_run : shard_receive_runs)
+        {
+            shard_receive_sizes[shard_run.shard] += shard_run.size;
+        }
+        shard_send_ptrs.clear();
+        shard_receive_data.clear();
+        for (size_t shard = 0; shard <= shards.size(); shard++)
+        {
+            shard_send_ptrs.emplace_back(shard_send_sizes[shard], &shard_default_value);
+            shard_receive_data.emplace_back(1 + shard_receive_sizes[shard], 0.0);
+        }
+    }
+
+    void start_connect_to_server_thread() override
+    {
+        connect_to_server();
+    }
+
+    void wait_for_connect_to_server_thread_finish() override
+    {
+    }
+
+    void start_meta_data_thread() override
+    {
+        send_and_receive_meta_data();
+    }
+
+    void wait_for_meta_data_thread_finish() override
+    {
+    }
+
+    bool init_objects(bool) override
+    {
+        return true;
+    }
+
+    void bind_request_meta_data() override
+    {
+        // Patterns are requested again on each handshake, so objects that appeared since are matched too
+        const std::map<std::string, std::set<std::string>> &requested_receive_objects = receive_request_objects.empty() ? receive_objects : receive_request_objects;
+
+        // An unchanged schema reuses the static portion of the request built for it
+        const uint64_t schema_hash = get_schema_hash(meta_data, send_objects, requested_receive_objects);
+        if (schema_hash == request_schema_hash && !schema_request_meta_data_str.empty())
+        {
+            build_request_meta_data_str();
+            return;
+        }
+        Json::Value schema_json;
+        if (RequestSchemaCache::get_instance().find(schema_hash, schema_json, schema_request_meta_data_str))
+        {
+            for (const char *member : {"meta_data", "send", "receive"})
+            {
+                request_meta_data_json.removeMember(member);
+                if (schema_json.isMember(member))
+                {
+                    request_meta_data_json[member] = schema_json[member];
+                }
+            }
+            request_schema_hash = schema_hash;
+            build_request_meta_data_str();
+            return;
+        }
+
+        // Create JSON object and populate it
+        if (!request_meta_data_json.isMember("api_callbacks"))
+        {
+            request_meta_data_json.clear();
+        }
+
+        request_meta_data_json["meta_data"]["world_name"] = meta_data["world_name"];
+        request_meta_data_json["meta_data"]["simulation_name"] = meta_data["simulation_name"];
+        request_meta_data_json["meta_data"]["length_unit"] = meta_data["length_unit"];
+        request_meta_data_json["meta_data"]["angle_unit"] = meta_data["angle_unit"];
+        request_meta_data_json["meta_data"]["mass_unit"] = meta_data["mass_unit"];
+        request_meta_data_json["meta_data"]["time_unit"] = meta_data["time_unit"];
+        request_meta_data_json["meta_data"]["handedness"] = meta_data["handedness"];
+
+        request_meta_data_json.removeMember("send");
+        request_meta_data_json.removeMember("receive");
+        for (const std::pair<const std::string, std::set<std::string>> &send_object : send_objects)
+        {
+            for (const std::string &attribute_name : send_object.second)
+            {
+                request_meta_data_json["send"][send_object.first].append(attribute_name);
+            }
+        }
+
+        for (const std::pair<const std::string, std::set<std::string>> &receive_object : requested_receive_objects)
+        {
+            for (const std::string &attribute_name : receive_object.second)
+            {
+                request_meta_data_json["receive"][receive_object.first].append(attribute_name);
+            }
+        }
+
+        schema_request_meta_data_str.clear();
+        append_json(request_meta_data_json, schema_request_meta_data_str, "api_callbacks");
+        request_schema_hash = schema_hash;
+        schema_json = request_meta_data_json;
+        schema_json.removeMember("api_callbacks");
+        RequestSchemaCache::get_instance().insert(schema_hash, schema_json, schema_request_meta_data_str);
+        build_request_meta_data_str();
+    }
+
+    /**
+     * Compact request: the static portion, followed by the API callbacks once they are requested. The string keeps
+     * its capacity, so requests of the same size do not allocate.
+     */
+    void build_request_meta_data_str()
+    {
+        request_meta_data_str.assign(schema_request_meta_data_str);
+        if (!request_meta_data_json.isMember("api_callbacks") || request_meta_data_str.empty())
+        {
+            return;
+        }
+        request_meta_data_str.pop_back();
+        request_meta_data_str += request_meta_data_str.size() > 1 ? ",\"api_callbacks\":" : "\"api_callbacks\":";
+        append_json(request_meta_data_json["api_callbacks"], request_meta_data_str);
+        request_meta_data_str += '}';
+    }
+
+    void bind_response_meta_data() override
+    {
+        // The same response as the bound one, e.g. after a reconnect, negotiated the same layout
+        const uint64_t response_hash = hash_field(response_meta_data_str);
+        if (response_hash == bound_response_hash && !response_meta_data_json.isMember("api_callbacks_response"))
+        {
+            is_layout_unchanged = true;
+            return;
+        }
+
+        std::map<std::string, std::set<std::string>> response_send_objects;
+        for (const std::string &object_name : response_meta_data_json["send"].getMemberNames())
+        {
+            response_send_objects[object_name] = {};
+            for (const std::string &attribute_name : response_meta_data_json["send"][object_name].getMemberNames())
+            {
+                response_send_objects[object_name].insert(attribute_name);
+            }
+        }
+
+        std::map<std::string, std::set<std::string>> response_receive_objects;
+        for (const std::string &object_name : response_meta_data_json["receive"].getMemberNames())
+        {
+            response_receive_objects[object_name] = {};
+            for (const std::string &attribute_name : response_meta_data_json["receive"][object_name].getMemberNames())
+            {
+                response_receive_objects[object_name].insert(attribute_name);
+            }
+        }
+
+        is_layout_unchanged = response_send_objects == send_objects && response_receive_objects == receive_objects;
+        send_objects = std::move(response_send_objects);
+        receive_objects = std::move(response_receive_objects);
+        bound_response_hash = response_hash;
+        if (!receive_pattern_objects.empty())
+        {
+            // get_own_receive_data reads the runs on the model thread, only the swap is done under its lock
+            std::vector<SlotRun> pattern_runs = get_pattern_runs(receive_objects, receive_pattern_objects, receive_pattern_max_objects_json);
+            std::lock_guard<std::mutex> lock(receive_data_mutex);
+            receive_pattern_runs.swap(pattern_runs);
+        }
+
+        std::lock_guard<std::mutex> lock(api_callbacks_mutex);
+        if (response_meta_data_json.isMember("api_callbacks_response"))
+        {
+            api_callbacks_response = response_meta_data_json["api_callbacks_response"];
+            decode_api_callbacks_outputs();
+        }
+        else
+        {
+            api_callbacks_response = Json::Value();
+        }
+    }
+
+    void decode_api_callbacks_outputs()
+    {
+        if (api_callbacks_outputs.empty())
+        {
+            return;
+        }
+        bool has_output = false;
+        for (const std::string &simulation_name : api_callbacks_response.getMemberNames())
+        {
+            for (const Json::Value &simulation_api_callback_response : api_callbacks_response[simulation_name])
+            {
+                for (const std::string &function_name : simulation_api_callback_response.getMemberNames())
+                {
+                    std::map<std::string, std::vector<double>>::iterator api_callbacks_output = api_callbacks_outputs.find(function_name);
+                    if (api_callbacks_output == api_callbacks_outputs.end())
+                    {
+                        continue;
+                    }
+                    std::vector<double> &data = api_callbacks_output->second;
+                    const std::vector<int> &shape = api_callbacks_output_shapes.at(function_name);
+                    if (shape.size() < 2)
+                    {
+                        const size_t size = decode_numbers(simulation_api_callback_response[function_name], data.data(), data.size());
+                        std::fill(data.begin() + size, data.end(), 0.0);
+                        has_output = true;
+                        continue;
+                    }
+
+                    // The numbers come in row-major order, Simulink matrices are column-major
+                    api_callbacks_output_rows.resize(data.size());
+                    const size_t size = decode_numbers(simulation_api_callback_response[function_name], api_callbacks_output_rows.data(), api_callbacks_output_rows.size());
+                    std::fill(api_callbacks_output_rows.begin() + size, api_callbacks_output_rows.end(), 0.0);
+                    const size_t rows = shape[0];
+                    const size_t cols = shape[1];
+                    for (size_t row = 0; row < rows; row++)
+                    {
+                        for (size_t col = 0; col < cols; col++)
+                        {
+                            data[row + col * rows] = api_callbacks_output_rows[row * cols + col];
+                        }
+                    }
+                    has_output = true;
+                }
+            }
+        }
+        if (has_output)
+        {
+            ++api_callbacks_outputs_count;
+        }
+    }
+
+    void bind_api_callbacks() override
+    {
+    }
+
+    void bind_api_callbacks_response() override
+    {
+    }
+
+    void init_send_and_receive_data() override
+    {
+        init_send_data();
+        init_receive_data();
+
+        // A handshake after a reconnect that negotiated the same layout into the same buffers keeps the bindings
+        if (is_layout_unchanged && send_buffer.buffer_double.data == bound_send_buffer && receive_buffer.buffer_double.data == bound_receive_buffer &&
+            send_objects_data.size() == send_objects.size() && receive_objects_data.size() == receive_objects.size())
+        {
+            init_typed_receive_data();
+            return;
+        }
+        bound_send_buffer = send_buffer.buffer_double.data;
+        bound_receive_buffer = receive_buffer.buffer_double.data;
+
+        double *send_buffer_double = send_buffer.buffer_double.data;
+        for (const std::pair<const std::string, std::set<std::string>> &send_object : send_objects)
+        {
+            send_objects_data[send_object.first] = {};
+            for (const std::string &attribute_name : send_object.second)
+            {
+                send_objects_data[send_object.first][attribute_name] = {};
+                for (size_t i = 0; i < get_wire_attribute_size(attribute_name); ++i)
+                {
+                    send_objects_data[send_object.first][attribute_name].emplace_back(send_buffer_double++);
+                }
+            }
+        }
+
+        double *receive_buffer_double = receive_buffer.buffer_double.data;
+        for (const std::pair<const std::string, std::set<std::string>> &receive_object : receive_objects)
+        {
+            receive_objects_data[receive_object.first] = {};
+            for (const std::string &attribute_name : receive_object.second)
+            {
+                receive_objects_data[receive_object.first][attribute_name] = {};
+                for (size_t i = 0; i < get_wire_attribute_size(attribute_name); ++i)
+                {
+                    receive_objects_data[receive_object.first][attribute_name].emplace_back(receive_buffer_double++);
+                }
+            }
+        }
+
+        init_typed_receive_data();
+        if (should_lock_memory)
+        {
+            lock_buffers();
+        }
+    }
+
+    /**
+     * Keep the exchange buffers resident, they are only locked again when the handshake reallocated them
+     */
+    void lock_buffers()
+    {
+        const std::vector<std::pair<const void *, size_t>> buffers = {
+            {send_buffer.buffer_double.data, send_buffer.buffer_double.size * sizeof(double)},
+            {receive_buffer.buffer_double.data, receive_buffer.buffer_double.size * sizeof(double)},
+            {send_data.data(), send_data.size() * sizeof(double)},
+            {send_batch.data(), send_batch.size() * sizeof(double)},
+            {receive_history.data(), receive_history.size() * sizeof(double)}};
+        if (buffers == memory_buffers)
+        {
+            return;
+        }
+        unlock_buffers();
+        memory_buffers = buffers;
+        for (const std::pair<const void *, size_t> &buffer : buffers)
+        {
+            if (buffer.first == nullptr || buffer.second == 0)
+            {
+                continue;
+            }
+            if (lock_memory(buffer.first, buffer.second))
+            {
+                locked_memory.push_back(buffer);
+            }
+            else
+            {
+                ++lock_memory_failure_count;
+            }
+        }
+    }
+
+    void unlock_buffers()
+    {
+        for (const std::pair<const void *, size_t> &buffer : locked_memory)
+        {
+            unlock_memory(buffer.first, buffer.second);
+        }
+        locked_memory.clear();
+    }
+
+    void init_typed_receive_data()
+    {
+        // The client library packs uint8 and uint16 attributes into their own buffers, in object and attribute order
+        std::map<std::pair<std::string, std::string>, size_t> offsets;
+        size_t uint8_offset = 0;
+        size_t uint16_offset = 0;
+        for (const std::pair<const std::string, std::set<std::string>> &receive_object : receive_objects)
+        {
+            for (const TypedPort &typed_port : typed_receive_ports)
+            {
+                if (typed_port.object_name != receive_object.first || receive_object.second.count(typed_port.attribute_name) == 0)
+                {
+                    continue;
+                }
+                size_t &offset = typed_port.attribute.data_type == "uint8" ? uint8_offset : uint16_offset;
+                offsets[{typed_port.object_name, typed_port.attribute_name}] = offset;
+                offset += typed_port.attribute.size;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(receive_data_mutex);
+        typed_receive_offsets.assign(typed_receive_ports.size(), typed_receive_no_offset);
+        for (size_t i = 0; i < typed_receive_ports.size(); i++)
+        {
+            const TypedPort &typed_port = typed_receive_ports[i];
+            std::map<std::pair<std::string, std::string>, size_t>::const_iterator offset = offsets.find({typed_port.object_name, typed_port.attribute_name});
+            if (offset == offsets.end())
+            {
+                continue;
+            }
+            const size_t buffer_size = typed_port.attribute.data_type == "uint8" ? receive_buffer.buffer_uint8_t.size : receive_buffer.buffer_uint16_t.size;
+            if (offset->second + typed_port.attribute.size <= buffer_size)
+            {
+                typed_receive_offsets[i] = offset->second;
+            }
+        }
+    }
+
+    /**
+     * Copy the typed receive data out of the client library buffers, which are only valid on the
+     * communicate thread and are reallocated by a handshake. Called with receive_data_mutex held.
+     */
+    void copy_typed_receive_data()
+    {
+        for (size_t i = 0; i < typed_receive_offsets.size(); i++)
+        {
+            if (typed_receive_offsets[i] == typed_receive_no_offset)
+            {
+                continue;
+            }
+            if (typed_receive_ports[i].attribute.data_type == "uint8")
+            {
+                std::memcpy(typed_receive_data[i].data(), receive_buffer.buffer_uint8_t.data + typed_receive_offsets[i], typed_receive_data[i].size());
+            }
+            else
+            {
+                std::memcpy(typed_receive_data[i].data(), receive_buffer.buffer_uint16_t.data + typed_receive_offsets[i], typed_receive_data[i].size());
+            }
+        }
+    }
+
+    /**
+     * Commit the values to send_data. With a deadband configured, a slot only takes a new value when it
+     * moved beyond its threshold, which also marks it dirty.
+     */
+    void stage_send_data(const double *const *values, const size_t size)
+    {
+        const size_t send_data_size = std::min(size, send_data.size());
+        const bool has_send_order = send_data_port.size() == send_data_size && send_data_size == size;
+        if (send_data_deadband.empty())
+        {
+            for (size_t i = 0; i < send_data_size; i++)
+            {
+                send_data[i] = *values[has_send_order ? send_data_port[i] : i];
+            }
+            return;
+        }
+
+        for (size_t i = 0; i < send_data_size; i++)
+        {
+            send_data_input[i] = *values[has_send_order ? send_data_port[i] : i];
+        }
+        for (size_t i = 0; i < send_data_size; i++)
+        {
+            const double value = send_data_input[i];
+            if (std::abs(value - send_data[i]) > send_data_deadband[i])
+            {
+                send_data[i] = value;
+                has_dirty_send_data = true;
+            }
+        }
+    }
+
+    /**
+     * Append the staged send data with its sim time to the batch. When the batch is full, the oldest sample is
+     * dropped, after waiting up to send_batch_wait for the communicate thread to drain it.
+     */
+    void push_send_batch_sample(std::unique_lock<std::mutex> &lock)
+    {
+        const size_t sample_size = 1 + send_data.size();
+        if (send_batch.size() != send_batch_size * sample_size)
+        {
+            return;
+        }
+        const auto has_space = [this]()
+        { return send_batch_count < send_batch_size || should_stop; };
+        // Waiting throttles the model to the network, so by default a full batch drops its oldest sample at once
+        const std::chrono::steady_clock::duration wait_time = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(send_batch_wait));
+        if (send_batch_count == send_batch_size && (send_batch_wait == 0.0 || !send_batch_condition.wait_for(lock, wait_time, has_space)))
+        {
+            send_batch_head = (send_batch_head + 1) % send_batch_size;
+            --send_batch_count;
+            ++send_batch_overrun_count;
+        }
+        if (send_batch_count == send_batch_size)
+        {
+            return;
+        }
+        double *sample = send_batch.data() + ((send_batch_head + send_batch_count) % send_batch_size) * sample_size;
+        sample[0] = sim_time;
+        std::copy(send_data.begin(), send_data.end(), sample + 1);
+        ++send_batch_count;
+        // The queued sample carries the changed values, the next one is only queued once a value moves again
+        has_dirty_send_data = false;
+    }
+
+    /**
+     * Move the oldest batched sample into send_batch_sample for the next exchange
+     */
+    bool pop_send_batch_sample()
+    {
+        std::lock_guard<std::mutex> lock(send_data_mutex);
+        if (send_batch_count == 0)
+        {
+            return false;
+        }
+        const size_t sample_size = 1 + send_data.size();
+        const double *sample = send_batch.data() + send_batch_head * sample_size;
+        send_batch_sample.assign(sample, sample + sample_size);
+        send_batch_head = (send_batch_head + 1) % send_batch_size;
+        --send_batch_count;
+        send_batch_condition.notify_one();
+        return true;
+    }
+
+    const double *get_receive_history_sample(const size_t index) const
+    {
+        return receive_history.data() + ((receive_history_head + index) % receive_history_size) * receive_history_sample_size;
+    }
+
+    /**
+     * Evaluate the receive history at evaluation_time, slot runs share the same interpolation weights
+     */
+    void interpolate_receive_data(double *data, const size_t size) const
+    {
+        const size_t newest = receive_history_count - 1;
+        const double time = evaluation_time;
+
+        // Pick the samples around time: [i0, i1] bracket it, or are the two newest ones when time is ahead
+        size_t i1 = newest;
+        while (i1 > 0 && get_receive_history_sample(i1 - 1)[0] > time)
+        {
+            --i1;
+        }
+        const size_t i0 = i1 > 0 ? i1 - 1 : 0;
+        const double *p0 = get_receive_history_sample(i0);
+        const double *p1 = get_receive_history_sample(i1);
+        const double *p_prev = get_receive_history_sample(i0 > 0 ? i0 - 1 : i0);
+        const double dt = p1[0] - p0[0];
+        const double alpha = dt > 0.0 ? (time - p0[0]) / dt : 1.0;
+        const double alpha_clamped = std::min(std::max(alpha, 0.0), 1.0);
+        const bool is_extrapolating = alpha > 1.0;
+
+        // Cubic Hermite basis with Catmull-Rom tangents between samples, constant velocity beyond the newest one
+        const double a = alpha_clamped;
+        const double h00 = 2 * a * a * a - 3 * a * a + 1;
+        const double h10 = a * a * a - 2 * a * a + a;
+        const double h01 = -2 * a * a * a + 3 * a * a;
+        const double h11 = a * a * a - a * a;
+        const double dt_prev = p1[0] - p_prev[0];
+        const double tangent_scale = dt_prev > 0.0 ? dt / dt_prev : 0.0;
+
+        for (const InterpolationRun &run : receive_data_interpolation)
+        {
+            const size_t end = std::min(run.end, size);
+            if (run.is_quaternion)
+            {
+                if (run.interpolation == EInterpolation::ZeroOrderHold)
+                {
+                    const double *p_hold = alpha >= 1.0 ? p1 : p0;
+                    std::copy(p_hold + 1 + run.begin, p_hold + 1 + end, data + run.begin);
+                    continue;
+                }
+                const double quaternion_alpha = run.interpolation == EInterpolation::Hermite ? std::max(alpha, 0.0) : alpha_clamped;
+                for (size_t i = run.begin; i + 4 <= end; i += 4)
+                {
+                    slerp(p0 + 1 + i, p1 + 1 + i, quaternion_alpha, data + i);
+                }
+                continue;
+            }
+
+            switch (run.interpolation)
+            {
+            case EInterpolation::ZeroOrderHold:
+                for (size_t i = run.begin; i < end; i++)
+                {
+                    data[i] = alpha >= 1.0 ? p1[1 + i] : p0[1 + i];
+                }
+                break;
+
+            case EInterpolation::Linear:
+                for (size_t i = run.begin; i < end; i++)
+                {
+                    data[i] = p0[1 + i] + (p1[1 + i] - p0[1 + i]) * alpha_clamped;
+                }
+                break;
+
+            case EInterpolation::Hermite:
+                if (is_extrapolating)
+                {
+                    for (size_t i = run.begin; i < end; i++)
+                    {
+                        data[i] = p0[1 + i] + (p1[1 + i] - p0[1 + i]) * alpha;
+                    }
+                }
+                else
+                {
+                    for (size_t i = run.begin; i < end; i++)
+                    {
+                        const double m = (p1[1 + i] - p_prev[1 + i]) * tangent_scale;
+                        data[i] = h00 * p0[1 + i] + h10 * m + h01 * p1[1 + i] + h11 * (p1[1 + i] - p0[1 + i]);
+                    }
+                }
+                break;
+            }
+        }
+    }
+
+    /**
+     * Communicate once and measure the round trip time. Only an exchange that communicate() reports as failed
+     * starts a reconnect: the client socket has no receive timeout, so an exchange with a server that stopped
+     * answering blocks until it answers, and is only reported overdue by the receive timeout.
+     */
+    void exchange()
+    {
+        const double time_now = get_time_now();
+        if (!communicate_with_deadline(false) && should_reconnect)
+        {
+            on_disconnect();
+            return;
+        }
+        const double time_end = get_time_now();
+        const double round_trip_time = time_end - time_now;
+
+        std::lock_guard<std::mutex> lock(receive_data_mutex);
+        double &round_trip_time_average = diagnostics[static_cast<size_t>(EDiagnostic::RoundTripTime)];
+        round_trip_time_average = round_trip_time_average == 0.0 ? round_trip_time : 0.9 * round_trip_time_average + 0.1 * round_trip_time;
+        if (has_clock_sync)
+        {
+            update_clock_sync(time_now, time_end, *world_time);
+        }
+    }
+
+    /**
+     * Communicate with the start time published, so the model side can tell when the exchange is overdue
+     */
+    bool communicate_with_deadline(const bool resend_request_meta_data)
+    {
+        exchange_start_time = get_time_now();
+        const bool is_communicated = communicate(resend_request_meta_data);
+        exchange_start_time = 0.0;
+        return is_communicated;
+    }
+
+    void on_disconnect()
+    {
+        is_connected = false;
+        reconnect_backoff = initial_reconnect_backoff;
+        next_reconnect_time = get_time_now() + reconnect_backoff;
+        std::lock_guard<std::mutex> lock(receive_data_mutex);
+        diagnostics[static_cast<size_t>(EDiagnostic::Connected)] = 0.0;
+    }
+
+    /**
+     * Handshake again once the backoff elapsed and double the backoff after each failure. Send samples queued
+     * while disconnected are dropped, so a full send batch does not block the model.
+     */
+    void reconnect()
+    {
+        while (send_batch_size > 0 && !should_stop && pop_send_batch_sample())
+        {
+        }
+        const double time_now = get_time_now();
+        if (time_now < next_reconnect_time)
+        {
+            return;
+        }
+        connect();
+        if (!communicate_with_deadline(true))
+        {
+            reconnect_backoff = std::min(2.0 * reconnect_backoff, reconnect_max_backoff);
+            next_reconnect_time = time_now + reconnect_backoff;
+            return;
+        }
+        is_connected = true;
+        std::lock_guard<std::mutex> lock(receive_data_mutex);
+        diagnostics[static_cast<size_t>(EDiagnostic::Connected)] = 1.0;
+        diagnostics[static_cast<size_t>(EDiagnostic::ReconnectCount)] = static_cast<double>(++reconnect_count);
+    }
+
+    /**
+     * NTP style clock filter: the offset between world_time and the wall clock is taken from the exchange with the
+     * smallest round trip time among the last few, the drift is the slope of an exponentially weighted least squares
+     * fit of the filtered offsets over the wall clock.
+     */
+    void update_clock_sync(const double send_wall_time, const double receive_wall_time, const double server_time)
+    {
+        if (clock_sync_count == 0)
+        {
+            clock_sync_start = send_wall_time;
+        }
+        const double wall_time = 0.5 * (send_wall_time + receive_wall_time) - clock_sync_start;
+        clock_sync_samples[clock_sync_count++ % clock_sync_samples.size()] = {wall_time, server_time - wall_time, receive_wall_time - send_wall_time};
+        const ClockSample *best_sample = &clock_sync_samples[0];
+        for (size_t i = 1; i < std::min(clock_sync_count, clock_sync_samples.size()); i++)
+        {
+            if (clock_sync_samples[i].delay < best_sample->delay)
+            {
+                best_sample = &clock_sync_samples[i];
+            }
+        }
+
+        constexpr double forgetting_factor = 0.99;
+        clock_sync_sums[0] = forgetting_factor * clock_sync_sums[0] + 1.0;
+        clock_sync_sums[1] = forgetting_factor * clock_sync_sums[1] + best_sample->wall_time;
+        clock_sync_sums[2] = forgetting_factor * clock_sync_sums[2] + best_sample->offset;
+        clock_sync_sums[3] = forgetting_factor * clock_sync_sums[3] + best_sample->wall_time * best_sample->wall_time;
+        clock_sync_sums[4] = forgetting_factor * clock_sync_sums[4] + best_sample->wall_time * best_sample->offset;
+        const double denominator = clock_sync_sums[0] * clock_sync_sums[3] - clock_sync_sums[1] * clock_sync_sums[1];
+        const double drift = denominator > 1E-9 ? (clock_sync_sums[0] * clock_sync_sums[4] - clock_sync_sums[1] * clock_sync_sums[2]) / denominator : 0.0;
+        const double offset = clock_sync_sums[2] / clock_sync_sums[0] + drift * (wall_time - clock_sync_sums[1] / clock_sync_sums[0]);
+
+        diagnostics[static_cast<size_t>(EDiagnostic::ClockOffset)] = offset - clock_sync_start;
+        diagnostics[static_cast<size_t>(EDiagnostic::ClockDrift)] = drift;
+        diagnostics[static_cast<size_t>(EDiagnostic::SimTimeOffset)] = offset + wall_time - sent_world_time;
+    }
+
+    void clear_clock_sync()
+    {
+        std::lock_guard<std::mutex> lock(receive_data_mutex);
+        clock_sync_count = 0;
+        clock_sync_sums.fill(0.0);
+    }
+
+    /**
+     * Warn once each time the Simulink clock leaves the tolerance around the synchronized world_time
+     */
+    void check_clock_sync()
+    {
+        double sim_time_offset;
+        {
+            std::lock_guard<std::mutex> lock(receive_data_mutex);
+            sim_time_offset = diagnostics[static_cast<size_t>(EDiagnostic::SimTimeOffset)];
+        }
+        const bool is_out_of_sync = std::abs(sim_time_offset) > clock_sync_tolerance;
+        if (is_out_of_sync && !is_clock_out_of_sync)
+        {
+            mexPrintf("Warning: The Simulink clock is %f s %s world_time, the world will be resynchronized if it keeps drifting.\n", std::abs(sim_time_offset), sim_time_offset > 0.0 ? "behind" : "ahead of");
+        }
+        is_clock_out_of_sync = is_out_of_sync;
+    }
+
+    /**
+     * Velocity of the receive slots [slot, slot + size) in the given history sample, from its relative_velocity
+     * if available or by finite difference with the sample before
+     */
+    bool get_receive_velocity(const size_t sample_index, const size_t slot, const size_t velocity_slot, const size_t size, double *velocity) const
+    {
+        const double *sample = get_receive_history_sample(sample_index);
+        if (velocity_slot != std::string::npos)
+        {
+            std::copy(sample + 1 + velocity_slot, sample + 1 + velocity_slot + size, velocity);
+            return true;
+        }
+        if (sample_index == 0)
+        {
+            return false;
+        }
+        const double *prev_sample = get_receive_history_sample(sample_index - 1);
+        const double dt = sample[0] - prev_sample[0];
+        if (dt <= 0.0)
+        {
+            return false;
+        }
+        for (size_t i = 0; i < size; i++)
+        {
+            velocity[i] = (sample[1 + slot + i] - prev_sample[1 + slot + i]) / dt;
+        }
+        return true;
+    }
+
+    /**
+     * Forward-predict the poses of the predicted objects by the age of the newest sample plus half the round trip
+     * time, assuming constant velocity. Positions of all objects are advanced in one batch.
+     */
+    void predict_receive_data(double *data, const size_t size)
+    {
+        const size_t newest = receive_history_count - 1;
+        const double *newest_sample = get_receive_history_sample(newest);
+        const double round_trip_time = diagnostics[static_cast<size_t>(EDiagnostic::RoundTripTime)];
+        const double horizon = std::min(std::max(get_time_now() - receive_wall_time + 0.5 * round_trip_time, 0.0), receive_prediction_max_horizon);
+        diagnostics[static_cast<size_t>(EDiagnostic::PredictionHorizon)] = horizon;
+
+        prediction_positions.clear();
+        prediction_velocities.clear();
+        for (const PredictedObject &predicted_object : predicted_objects)
+        {
+            if (predicted_object.position == std::string::npos || predicted_object.position + 3 > size)
+            {
+                continue;
+            }
+            double velocity[3] = {0.0, 0.0, 0.0};
+            get_receive_velocity(newest, predicted_object.position, predicted_object.relative_velocity, 3, velocity);
+            prediction_positions.insert(prediction_positions.end(), newest_sample + 1 + predicted_object.position, newest_sample + 4 + predicted_object.position);
+            prediction_velocities.insert(prediction_velocities.end(), velocity, velocity + 3);
+        }
+        multiply_add(prediction_positions.data(), prediction_velocities.data(), horizon, prediction_positions.size());
+
+        size_t i = 0;
+        for (const PredictedObject &predicted_object : predicted_objects)
+        {
+            if (predicted_object.position != std::string::npos && predicted_object.position + 3 <= size)
+            {
+                std::copy(prediction_positions.begin() + i, prediction_positions.begin() + i + 3, data + predicted_object.position);
+                i += 3;
+            }
+            if (predicted_object.quaternion == std::string::npos || predicted_object.quaternion + 4 > size)
+            {
+                continue;
+            }
+            const double *quaternion = newest_sample + 1 + predicted_object.quaternion;
+            if (predicted_object.relative_velocity != std::string::npos)
+            {
+                // The angular velocity is in the model angle unit per second
+                integrate_quaternion(quaternion, newest_sample + 4 + predicted_object.relative_velocity, horizon / unit_conversion.angle, data + predicted_object.quaternion);
+            }
+            else if (newest > 0 && newest_sample[0] > get_receive_history_sample(newest - 1)[0])
+            {
+                const double *prev_sample = get_receive_history_sample(newest - 1);
+                slerp(prev_sample + 1 + predicted_object.quaternion, quaternion, 1.0 + horizon / (newest_sample[0] - prev_sample[0]), data + predicted_object.quaternion);
+            }
+        }
+    }
+
+    /**
+     * RMS position error of the one step prediction from the previous sample to the newest one
+     */
+    void update_prediction_error()
+    {
+        if (receive_history_count < 2)
+        {
+            return;
+        }
+        const size_t newest = receive_history_count - 1;
+        const double *newest_sample = get_receive_history_sample(newest);
+        const double *prev_sample = get_receive_history_sample(newest - 1);
+        const double dt = newest_sample[0] - prev_sample[0];
+        double squared_error = 0.0;
+        size_t predicted_size = 0;
+        for (const PredictedObject &predicted_object : predicted_objects)
+        {
+            double velocity[3];
+            if (predicted_object.position == std::string::npos || !get_receive_velocity(newest - 1, predicted_object.position, predicted_object.relative_velocity, 3, velocity))
+            {
+                continue;
+            }
+            for (size_t i = 0; i < 3; i++)
+            {
+                const double error = prev_sample[1 + predicted_object.position + i] + velocity[i] * dt - newest_sample[1 + predicted_object.position + i];
+                squared_error += error * error;
+            }
+            ++predicted_size;
+        }
+        if (predicted_size > 0)
+        {
+            diagnostics[static_cast<size_t>(EDiagnostic::PredictionError)] = std::sqrt(squared_error / predicted_size);
+        }
+    }
+
+    void init_receive_data()
+    {
+        std::lock_guard<std::mutex> lock(receive_data_mutex);
+        receive_data_codec = get_codec_runs(receive_objects);
+        receive_history_sample_size = 1 + get_receive_data_size();
+        if (receive_history.size() != receive_history_size * receive_history_sample_size)
+        {
+            receive_history.assign(receive_history_size * receive_history_sample_size, 0.0);
+            receive_history_head = 0;
+            receive_history_count = 0;
+        }
+        receive_data_scale.clear();
+        if (!unit_conversion.is_identity())
+        {
+            receive_data_scale = get_unit_scales(receive_objects, unit_conversion);
+        }
+        receive_port_order = get_port_order(receive_objects, receive_order_json);
+        init_predicted_objects();
+        if (receive_interpolation_json.isNull())
+        {
+            return;
+        }
+
+        receive_data_interpolation.clear();
+        size_t slot = 0;
+        for (const std::pair<const std::string, std::set<std::string>> &receive_object : receive_objects)
+        {
+            for (const std::string &attribute_name : receive_object.second)
+            {
+                const size_t attribute_size = get_attribute_size(attribute_name);
+                const Json::Value interpolation_json = receive_interpolation_json.get(receive_object.first + ":" + attribute_name, receive_interpolation_json.get(attribute_name, "zoh"));
+                EInterpolation interpolation = EInterpolation::ZeroOrderHold;
+                get_interpolation(interpolation_json, interpolation);
+                const bool is_quaternion = is_quaternion_attribute(attribute_name);
+                if (!receive_data_interpolation.empty() && receive_data_interpolation.back().end == slot && receive_data_interpolation.back().interpolation == interpolation && receive_data_interpolation.back().is_quaternion == is_quaternion)
                 {
-                    receive_objects_data[receive_object.first][attribute_name].emplace_back(receive_buffer_double++);
+                    receive_data_interpolation.back().end += attribute_size;
+                }
+                else
+                {
+                    receive_data_interpolation.push_back({slot, slot + attribute_size, interpolation, is_quaternion});
+                }
+                slot += attribute_size;
+            }
+        }
+    }
+
+    void init_predicted_objects()
+    {
+        predicted_objects.clear();
+        if (receive_prediction_json.isNull() || (receive_prediction_json.isBool() && !receive_prediction_json.asBool()))
+        {
+            return;
+        }
+        std::set<std::string> predicted_object_names;
+        for (const Json::Value &object_name : receive_prediction_json)
+        {
+            predicted_object_names.insert(object_name.asString());
+        }
+        size_t slot = 0;
+        for (const std::pair<const std::string, std::set<std::string>> &receive_object : receive_objects)
+        {
+            PredictedObject predicted_object = {std::string::npos, std::string::npos, std::string::npos};
+            for (const std::string &attribute_name : receive_object.second)
+            {
+                if (attribute_name == "position")
+                {
+                    predicted_object.position = slot;
+                }
+                else if (attribute_name == "quaternion")
+                {
+                    predicted_object.quaternion = slot;
+                }
+                else if (attribute_name == "relative_velocity")
+                {
+                    predicted_object.relative_velocity = slot;
                 }
+                slot += get_attribute_size(attribute_name);
+            }
+            const bool is_predicted = receive_prediction_json.isBool() || predicted_object_names.count(receive_object.first) > 0;
+            if (is_predicted && (predicted_object.position != std::string::npos || predicted_object.quaternion != std::string::npos))
+            {
+                predicted_objects.push_back(predicted_object);
+            }
+        }
+    }
+
+    void init_send_data()
+    {
+        std::lock_guard<std::mutex> lock(send_data_mutex);
+        send_data_codec = get_codec_runs(send_objects);
+        send_data.resize(get_send_data_size(), 0.0);
+        send_data_encoded.resize(send_data_codec.empty() ? 0 : send_data.size());
+        send_data_input.resize(send_data.size(), 0.0);
+        if (send_batch_size > 0 && send_batch.size() != send_batch_size * (1 + send_data.size()))
+        {
+            send_batch.assign(send_batch_size * (1 + send_data.size()), 0.0);
+            send_batch_head = 0;
+            send_batch_count = 0;
+        }
+        send_data_port.clear();
+        for (const SlotRun &slot_run : get_port_order(send_objects, send_order_json))
+        {
+            send_data_port.resize(send_data.size(), 0);
+            for (size_t i = 0; i < slot_run.size && slot_run.slot + i < send_data_port.size(); i++)
+            {
+                send_data_port[slot_run.slot + i] = slot_run.port + i;
+            }
+        }
+        send_data_scale.clear();
+        if (!unit_conversion.is_identity())
+        {
+            send_data_scale = get_unit_scales(send_objects, unit_conversion);
+            for (double &scale : send_data_scale)
+            {
+                scale = 1.0 / scale;
+            }
+        }
+        if (send_deadband_json.isNull())
+        {
+            return;
+        }
+
+        send_data_deadband.clear();
+        for (const std::pair<const std::string, std::set<std::string>> &send_object : send_objects)
+        {
+            for (const std::string &attribute_name : send_object.second)
+            {
+                const std::string slot_name = send_object.first + ":" + attribute_name;
+                const double deadband = send_deadband_json.get(slot_name, send_deadband_json.get(attribute_name, 0.0)).asDouble();
+                send_data_deadband.insert(send_data_deadband.end(), get_attribute_size(attribute_name), deadband);
+            }
+        }
+        send_data_deadband.resize(send_data.size(), 0.0);
+        has_dirty_send_data = true;
+    }
+
+    /**
+     * Decide whether this tick exchanges data. With a deadband configured, ticks without dirty
+     * slots are skipped, except for a keyframe every send_keyframe_interval ticks. A keyframe sends the
+     * latest input in full, which corrects values that settled within their threshold.
+     */
+    bool should_exchange()
+    {
+        if (send_deadband_json.isNull())
+        {
+            return true;
+        }
+        std::lock_guard<std::mutex> lock(send_data_mutex);
+        const bool is_keyframe = ++ticks_since_keyframe >= send_keyframe_interval;
+        if (is_keyframe)
+        {
+            ticks_since_keyframe = 0;
+            std::copy(send_data_input.begin(), send_data_input.end(), send_data.begin());
+        }
+        if (has_dirty_send_data || is_keyframe)
+        {
+            ++exchange_count;
+            return true;
+        }
+        ++skipped_exchange_count;
+        return false;
+    }
+
+    /**
+     * Copy the send data to the send buffer, converted to the server units and packed if attributes are encoded
+     */
+    void copy_send_data(const double *data)
+    {
+        if (!send_data_codec.empty())
+        {
+            if (send_data_scale.size() == send_data.size())
+            {
+                multiply(send_data_encoded.data(), data, send_data_scale.data(), send_data_scale.size());
+                data = send_data_encoded.data();
+            }
+            encode_data(data, send_data_codec, send_buffer.buffer_double.data, send_buffer.buffer_double.size);
+        }
+        else if (send_data_scale.size() == send_buffer.buffer_double.size)
+        {
+            multiply(send_buffer.buffer_double.data, data, send_data_scale.data(), send_data_scale.size());
+        }
+        else
+        {
+            std::copy(data, data + send_buffer.buffer_double.size, send_buffer.buffer_double.data);
+        }
+    }
+
+    void bind_send_data() override
+    {
+        std::lock_guard<std::mutex> lock(send_data_mutex);
+        if (send_batch_size > 0 && send_batch_sample.size() == 1 + get_send_data_size())
+        {
+            *world_time = send_batch_sample[0];
+            sent_world_time = send_batch_sample[0];
+            copy_send_data(send_batch_sample.data() + 1);
+            return;
+        }
+
+        *world_time = sim_time;
+        sent_world_time = sim_time;
+        if (send_data.size() == get_send_data_size())
+        {
+            copy_send_data(send_data.data());
+        }
+        has_dirty_send_data = false;
+    }
+
+    void bind_receive_data() override
+    {
+        std::lock_guard<std::mutex> lock(receive_data_mutex);
+        copy_typed_receive_data();
+        if (receive_history_sample_size != 1 + get_receive_data_size() || receive_history.empty())
+        {
+            return;
+        }
+
+        // A sample with the same world_time replaces the newest one, an older world_time means the world was reset
+        const double time = *world_time;
+        if (receive_history_count > 0)
+        {
+            const double newest_time = get_receive_history_sample(receive_history_count - 1)[0];
+            if (time < newest_time)
+            {
+                receive_history_count = 0;
+                on_world_reset();
+            }
+            else if (time == newest_time)
+            {
+                --receive_history_count;
+            }
+        }
+        if (receive_history_count == receive_history_size)
+        {
+            receive_history_head = (receive_history_head + 1) % receive_history_size;
+            --receive_history_count;
+        }
+        double *sample = receive_history.data() + ((receive_history_head + receive_history_count) % receive_history_size) * receive_history_sample_size;
+        sample[0] = time;
+        if (!receive_data_codec.empty())
+        {
+            decode_data(receive_buffer.buffer_double.data, receive_buffer.buffer_double.size, receive_data_codec, sample + 1);
+            if (receive_data_scale.size() == receive_history_sample_size - 1)
+            {
+                multiply(sample + 1, sample + 1, receive_data_scale.data(), receive_data_scale.size());
+            }
+        }
+        else if (receive_data_scale.size() == receive_buffer.buffer_double.size)
+        {
+            multiply(sample + 1, receive_buffer.buffer_double.data, receive_data_scale.data(), receive_data_scale.size());
+        }
+        else
+        {
+            std::copy(receive_buffer.buffer_double.data, receive_buffer.buffer_double.data + receive_buffer.buffer_double.size, sample + 1);
+        }
+        ++receive_history_count;
+        const double time_now = get_time_now();
+        if (is_reset_pending)
+        {
+            // Wall time from the last sample of the previous run to the first sample of the new one
+            if (receive_wall_time > 0.0)
+            {
+                diagnostics[static_cast<size_t>(EDiagnostic::ResetTurnaround)] = time_now - receive_wall_time;
             }
+            is_reset_pending = false;
+        }
+        receive_wall_time = time_now;
+        if (!predicted_objects.empty())
+        {
+            update_prediction_error();
+        }
+    }
+
+    void clean_up() override
+    {
+        send_objects_data.clear();
+        receive_objects_data.clear();
+        std::lock_guard<std::mutex> lock(receive_data_mutex);
+        typed_receive_offsets.assign(typed_receive_ports.size(), typed_receive_no_offset);
+    }
+
+    void reset() override
+    {
+        {
+            std::lock_guard<std::mutex> lock(send_data_mutex);
+            sim_time = 0.0;
+        }
+        clear_clock_sync();
+        std::lock_guard<std::mutex> lock(receive_data_mutex);
+        // The client resets at most once per cool down, a world reset seen in the receive data just before is the same one
+        if (get_time_now() - last_reset_wall_time >= 1.0)
+        {
+            on_world_reset();
+        }
+    }
+
+    /**
+     * Count a world reset and signal it to the next major time step. Called with receive_data_mutex held.
+     */
+    void on_world_reset()
+    {
+        last_reset_wall_time = get_time_now();
+        is_reset_pending = true;
+        diagnostics[static_cast<size_t>(EDiagnostic::ResetCount)] = static_cast<double>(++reset_count);
+        if (is_reset_in_place)
+        {
+            reset_run_state();
         }
     }
 
-    void bind_send_data() override
-    {
-        *world_time = sim_time;
-    }
+    /**
+     * Drop the state of the previous run and keep the socket and the bound buffers, so the next exchange starts
+     * the new run at once
+     */
+    void reset_run_state()
+    {
+        receive_history_count = 0;
+        diagnostics[static_cast<size_t>(EDiagnostic::PredictionError)] = 0.0;
+        std::lock_guard<std::mutex> lock(send_data_mutex);
+        send_batch_count = 0;
+        send_batch_head = 0;
+        send_batch_condition.notify_all();
+        // The next exchange is a keyframe, which replaces the deadband reference with the latest input
+        ticks_since_keyframe = send_keyframe_interval;
+        has_dirty_send_data = true;
+    }
+
+private:
+    std::map<std::string, std::string> meta_data;
+
+    std::map<std::string, std::set<std::string>> send_objects;
+
+    std::map<std::string, std::set<std::string>> receive_objects;
+
+    std::map<std::string, std::map<std::string, std::vector<double *>>> send_objects_data;
+
+    std::map<std::string, std::map<std::string, std::vector<double *>>> receive_objects_data;
+
+    Json::Value api_callbacks;
+
+    Json::Value api_callbacks_response;
+
+    std::map<std::string, std::vector<double>> api_callbacks_outputs;
+
+    std::map<std::string, std::vector<int>> api_callbacks_output_shapes;
+
+    std::vector<double> api_callbacks_output_rows;
+
+    size_t api_callbacks_outputs_count = 0;
+
+    size_t api_callbacks_outputs_read_count = 0;
+
+    std::mutex api_callbacks_mutex;
+
+    std::vector<std::string> custom_attribute_names;
+
+    std::vector<TypedPort> typed_receive_ports;
+
+    const size_t typed_receive_no_offset = static_cast<size_t>(-1);
+
+    std::vector<size_t> typed_receive_offsets;
+
+    std::vector<std::vector<uint8_t>> typed_receive_data;
+
+    std::vector<double> send_data;
+
+    std::vector<double> send_data_input;
+
+    std::vector<CodecRun> send_data_codec;
+
+    std::vector<double> send_data_encoded;
+
+    std::vector<CodecRun> receive_data_codec;
+
+    std::vector<double> send_data_deadband;
+
+    bool has_dirty_send_data = false;
+
+    std::mutex send_data_mutex;
+
+    Json::Value send_deadband_json;
+
+    unsigned int send_keyframe_interval = 100;
+
+    unsigned int ticks_since_keyframe = 0;
+
+    std::vector<double> receive_history;
+
+    unsigned int receive_history_size = 1;
+
+    size_t receive_history_sample_size = 0;
+
+    size_t receive_history_head = 0;
+
+    size_t receive_history_count = 0;
+
+    Json::Value receive_interpolation_json;
+
+    std::vector<InterpolationRun> receive_data_interpolation;
+
+    Json::Value receive_prediction_json;
+
+    double receive_prediction_max_horizon = 0.1;
+
+    std::vector<PredictedObject> predicted_objects;
+
+    std::vector<double> prediction_positions;
+
+    std::vector<double> prediction_velocities;
+
+    double receive_wall_time = 0.0;
+
+    bool has_diagnostics = false;
+
+    std::array<double, static_cast<size_t>(EDiagnostic::Size)> diagnostics = {};
+
+    OutputPorts output_ports;
+
+    std::vector<double> receive_data_snapshot;
+
+    UnitConversion unit_conversion;
+
+    std::vector<double> send_data_scale;
+
+    std::vector<double> receive_data_scale;
+
+    Json::Value send_order_json;
+
+    std::vector<size_t> send_data_port;
+
+    Json::Value receive_order_json;
+
+    std::vector<SlotRun> receive_port_order;
+
+    std::vector<double> receive_port_data;
+
+    std::vector<double> receive_ports_data;
+
+    std::vector<const double *> send_ports_ptrs;
+
+    std::vector<MultiverseConnector *> shards;
+
+    std::vector<ShardRun> shard_send_runs;
+
+    std::vector<ShardRun> shard_receive_runs;
+
+    std::vector<std::vector<const double *>> shard_send_ptrs;
+
+    std::vector<std::vector<double>> shard_receive_data;
+
+    const double shard_default_value = 0.0;
+
+    EPacing pacing = EPacing::None;
+
+    double pacing_spin_time = 0.001;
+
+    bool has_pacing_start = false;
+
+    std::chrono::steady_clock::time_point pacing_start;
+
+    double pacing_start_sim_time = 0.0;
+
+    size_t pacing_overrun_count = 0;
+
+    double pacing_max_lag = 0.0;
+
+    std::atomic<size_t> reset_count{0};
+
+    size_t reset_count_seen = 0;
+
+    bool is_reset_in_place = false;
+
+    bool is_reset_pending = false;
+
+    double last_reset_wall_time = 0.0;
+
+    bool has_clock_sync = false;
+
+    double clock_sync_tolerance = 0.5;
+
+    bool is_clock_out_of_sync = false;
+
+    double clock_sync_start = 0.0;
+
+    std::array<ClockSample, 8> clock_sync_samples = {};
+
+    size_t clock_sync_count = 0;
+
+    std::array<double, 5> clock_sync_sums = {};
+
+    double sent_world_time = 0.0;
+
+    std::mutex receive_data_mutex;
+
+    unsigned int send_batch_size = 0;
+
+    double send_batch_wait = 0.0;
+
+    std::vector<double> send_batch;
+
+    size_t send_batch_head = 0;
+
+    size_t send_batch_count = 0;
+
+    std::vector<double> send_batch_sample;
+
+    std::condition_variable send_batch_condition;
+
+    size_t send_batch_overrun_count = 0;
+
+    size_t exchange_count = 0;
+
+    size_t skipped_exchange_count = 0;
+
+    std::thread *communicate_thread = nullptr;
+
+    std::atomic<bool> should_stop{false};
+
+    bool has_shared_io_thread = false;
+
+    ThreadScheduling thread_scheduling;
+
+    double last_tick_time = 0.0;
+
+    double max_loop_jitter = 0.0;
+
+    bool should_lock_memory = false;
+
+    std::vector<std::pair<const void *, size_t>> memory_buffers;
+
+    std::vector<std::pair<const void *, size_t>> locked_memory;
+
+    size_t lock_memory_failure_count = 0;
+
+    bool should_reconnect = false;
+
+    std::atomic<bool> is_connected{true};
+
+    EDegradedPolicy disconnect_policy = EDegradedPolicy::Hold;
+
+    static constexpr double initial_reconnect_backoff = 0.1;
+
+    double reconnect_backoff = initial_reconnect_backoff;
+
+    double reconnect_max_backoff = 5.0;
+
+    double next_reconnect_time = 0.0;
+
+    size_t reconnect_count = 0;
+
+    bool is_layout_unchanged = false;
+
+    const double *bound_send_buffer = nullptr;
+
+    const double *bound_receive_buffer = nullptr;
+
+    uint64_t request_schema_hash = 0;
+
+    std::string schema_request_meta_data_str;
 
-    void bind_receive_data() override
-    {
-    }
+    uint64_t bound_response_hash = 0;
 
-    void clean_up() override
-    {
-        send_objects_data.clear();
-        receive_objects_data.clear();
-    }
+    std::map<std::string, std::set<std::string>> receive_pattern_objects;
 
-    void reset() override
-    {
-        sim_time = 0.0;
-    }
+    std::map<std::string, std::set<std::string>> receive_request_objects;
 
-private:
-    std::map<std::string, std::string> meta_data;
+    Json::Value receive_pattern_max_objects_json;
 
-    std::map<std::string, std::set<std::string>> send_objects;
+    std::vector<SlotRun> receive_pattern_runs;
 
-    std::map<std::string, std::set<std::string>> receive_objects;
+    std::vector<double> receive_pattern_data;
 
-    std::map<std::string, std::map<std::string, std::vector<double *>>> send_objects_data;
+    double receive_timeout = 0.0;
 
-    std::map<std::string, std::map<std::string, std::vector<double *>>> receive_objects_data;
+    EDegradedPolicy receive_timeout_policy = EDegradedPolicy::Hold;
 
-    Json::Value api_callbacks;
+    unsigned int receive_timeout_max_misses = 10;
 
-    Json::Value api_callbacks_response;
+    std::atomic<double> exchange_start_time{0.0};
 
-    std::thread *communicate_thread = nullptr;
+    bool is_receive_overdue = false;
 
-    bool should_stop = false;
+    size_t consecutive_receive_miss_count = 0;
 
-    double sim_time;
+    size_t receive_miss_count = 0;
+
+    double sim_time = 0.0;
+
+    double evaluation_time = 0.0;
 
     double time_step = 0.001;
 };
 
+std::string ConnectorReactor::add(MultiverseConnector *connector, const ThreadScheduling &thread_scheduling)
+{
+    std::promise<std::string> scheduling_result;
+    std::future<std::string> scheduling_error = scheduling_result.get_future();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.push_back({connector, std::chrono::steady_clock::now()});
+        if (thread != nullptr)
+        {
+            condition.notify_all();
+            return "";
+        }
+        should_stop = false;
+        thread = new std::thread(&ConnectorReactor::run, this, thread_scheduling, &scheduling_result);
+    }
+    return scheduling_error.get();
+}
+
+void ConnectorReactor::remove(MultiverseConnector *connector)
+{
+    std::thread *stopped_thread = nullptr;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [this, connector]()
+                       { return serving_connector != connector; });
+        entries.erase(std::remove_if(entries.begin(), entries.end(), [connector](const Entry &entry)
+                                     { return entry.connector == connector; }),
+                      entries.end());
+        if (entries.empty() && thread != nullptr)
+        {
+            should_stop = true;
+            stopped_thread = thread;
+            thread = nullptr;
+            condition.notify_all();
+        }
+    }
+    if (stopped_thread != nullptr)
+    {
+        stopped_thread->join();
+        delete stopped_thread;
+    }
+}
+
+void ConnectorReactor::run(const ThreadScheduling thread_scheduling, std::promise<std::string> *scheduling_result)
+{
+    scheduling_result->set_value(set_current_thread_scheduling(thread_scheduling));
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!should_stop)
+    {
+        if (entries.empty())
+        {
+            condition.wait(lock);
+            continue;
+        }
+        const std::vector<Entry>::iterator entry = std::min_element(entries.begin(), entries.end(), [](const Entry &a, const Entry &b)
+                                                                    { return a.deadline < b.deadline; });
+        if (entry->deadline > std::chrono::steady_clock::now())
+        {
+            condition.wait_until(lock, entry->deadline);
+            continue;
+        }
+
+        MultiverseConnector *connector = entry->connector;
+        serving_connector = connector;
+        lock.unlock();
+        connector->tick();
+        lock.lock();
+        serving_connector = nullptr;
+        condition.notify_all();
+
+        // Deadlines are absolute, a connector that fell behind is served again at once but does not catch up in a burst
+        const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        for (Entry &served_entry : entries)
+        {
+            if (served_entry.connector == connector)
+            {
+                served_entry.deadline = std::max(served_entry.deadline + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(connector->get_time_step())), now);
+            }
+        }
+    }
+}
+
 static void mdlInitializeSizes(SimStruct *S) /* Initialize the input and output ports and their size */
 {
     ssSetNumSFcnParams(S, 7);
@@ -426,20 +4051,107 @@ static void mdlInitializeSizes(SimStruct *S) /* Initialize the input and output
     }
     const Json::Value param_json = string_to_json(param_str);
 
+    std::map<std::string, DeclaredAttribute> declared_attributes;
+    std::string declared_attributes_error;
+    if (!get_declared_attributes(param_json, declared_attributes, declared_attributes_error))
+    {
+        ssSetErrorStatus(S, declared_attributes_error.c_str());
+        return;
+    }
+    register_custom_attributes(declared_attributes);
+    const std::vector<TypedPort> typed_receive_ports = get_typed_receive_ports(param_json, declared_attributes);
+
+    UnitConversion unit_conversion;
+    std::string unit_conversion_error;
+    if (!get_unit_conversion(param_json, unit_conversion, unit_conversion_error))
+    {
+        ssSetErrorStatus(S, unit_conversion_error.c_str());
+        return;
+    }
+
+    std::string shards_error;
+    if (param_json.isMember("shards") && !check_shards(param_json, shards_error))
+    {
+        ssSetErrorStatus(S, shards_error.c_str());
+        return;
+    }
+
+    std::string port_order_error;
+    if (!check_port_order(param_json["send"], param_json["send_order"], port_order_error) ||
+        !check_port_order(param_json["receive"], param_json["receive_order"], port_order_error))
+    {
+        ssSetErrorStatus(S, port_order_error.c_str());
+        return;
+    }
+
+    const std::string port_layout = param_json.get("port_layout", "vector").asString();
+    if (port_layout != "vector" && port_layout != "object" && port_layout != "attribute")
+    {
+        const std::string error_message = "Port layout: " + port_layout + " must be vector, object or attribute.";
+        ssSetErrorStatus(S, error_message.c_str());
+        return;
+    }
+
+    // Batched worlds share one schema, each world is one row of the [N x width] ports
+    const bool is_batched = param_json.isMember("worlds");
+    const int_T world_count = is_batched ? param_json["worlds"].size() : 1;
+    if (is_batched)
+    {
+        if (!param_json["worlds"].isArray() || world_count == 0)
+        {
+            ssSetErrorStatus(S, "worlds must be a non-empty array of world names.");
+            return;
+        }
+        // Counting up from the client port of the block would take ports of other blocks
+        const Json::Value &client_ports_json = param_json["client_ports"];
+        std::set<std::string> world_client_ports;
+        if (!client_ports_json.isArray() || client_ports_json.size() != param_json["worlds"].size() ||
+            !std::all_of(client_ports_json.begin(), client_ports_json.end(), [&world_client_ports](const Json::Value &client_port)
+                         { return client_port.isString() && world_client_ports.insert(client_port.asString()).second; }))
+        {
+            ssSetErrorStatus(S, "Batched worlds must declare client_ports, one distinct client port per world.");
+            return;
+        }
+        if (port_layout != "vector" || !typed_receive_ports.empty() || param_json.isMember("api_callbacks_outputs") || get_api_callbacks_output_size(param_json) > 0)
+        {
+            ssSetErrorStatus(S, "Batched worlds only support the vector port layout without API callback or typed outputs.");
+            return;
+        }
+    }
+
+    // Ticks skipped by the deadband also skip the receive update, a block that receives data has to accept that
+    if (param_json.isMember("send_deadband") && !param_json["receive"].empty() && !param_json.get("send_deadband_skips_receive", false).asBool())
+    {
+        ssSetErrorStatus(S, "send_deadband skips the receive update on skipped ticks, set send_deadband_skips_receive to true on a block that receives data.");
+        return;
+    }
+
     int input_port_size = 1;
     if (param_json.isMember("send"))
     {
         for (const std::string &object_name : param_json["send"].getMemberNames())
         {
+            if (is_object_pattern(object_name))
+            {
+                const std::string error_message = "Object pattern: " + object_name + " can only be received.";
+                ssSetErrorStatus(S, error_message.c_str());
+                return;
+            }
             for (const Json::Value &attribute_name : param_json["send"][object_name])
             {
+                if (declared_attributes.count(attribute_name.asString()) != 0 && declared_attributes.at(attribute_name.asString()).data_type != "double")
+                {
+                    const std::string error_message = "Attribute: " + attribute_name.asString() + " can only be received.";
+                    ssSetErrorStatus(S, error_message.c_str());
+                    return;
+                }
                 if (attribute_map_double.find(attribute_name.asString()) == attribute_map_double.end())
                 {
                     const std::string error_message = "Attribute: " + attribute_name.asString() + " not found in attribute_map_double.";
                     ssSetErrorStatus(S, error_message.c_str());
                     return;
                 }
-                input_port_size += attribute_map_double[attribute_name.asString()];
+                input_port_size += get_attribute_size(attribute_name.asString());
             }
         }
     }
@@ -454,15 +4166,36 @@ static void mdlInitializeSizes(SimStruct *S) /* Initialize the input and output
     {
         for (const std::string &object_name : param_json["receive"].getMemberNames())
         {
+            if (is_object_pattern(object_name))
+            {
+                // Checked before any asUInt, which throws on user input of another type
+                const Json::Value &max_objects_json = param_json["receive_pattern_max_objects"];
+                if (!max_objects_json.isObject() || !max_objects_json[object_name].isUInt() || max_objects_json[object_name].asUInt() == 0)
+                {
+                    const std::string error_message = "Object pattern: " + object_name + " must declare its maximum number of objects as a positive integer in receive_pattern_max_objects.";
+                    ssSetErrorStatus(S, error_message.c_str());
+                    return;
+                }
+                if (port_layout != "vector" || param_json.isMember("receive_order") || param_json.isMember("shards"))
+                {
+                    ssSetErrorStatus(S, "Object patterns only support the vector port layout without receive_order or shards.");
+                    return;
+                }
+            }
+            const size_t object_count = get_receive_object_count(param_json["receive_pattern_max_objects"], object_name);
             for (const Json::Value &attribute_name : param_json["receive"][object_name])
             {
+                if (declared_attributes.count(attribute_name.asString()) != 0 && declared_attributes.at(attribute_name.asString()).data_type != "double")
+                {
+                    continue;
+                }
                 if (attribute_map_double.find(attribute_name.asString()) == attribute_map_double.end())
                 {
                     const std::string error_message = "Attribute: " + attribute_name.asString() + " not found in attribute_map_double.";
                     ssSetErrorStatus(S, error_message.c_str());
                     return;
                 }
-                output_port_size += attribute_map_double[attribute_name.asString()];
+                output_port_size += get_attribute_size(attribute_name.asString()) * object_count;
             }
         }
     }
@@ -472,23 +4205,147 @@ static void mdlInitializeSizes(SimStruct *S) /* Initialize the input and output
     }
     mexPrintf("Output port size: %d\n", output_port_size);
 
-    if (!ssSetNumInputPorts(S, 1))
+    if (param_json.isMember("api_callbacks_output_size") && (!param_json["api_callbacks_output_size"].isIntegral() || param_json["api_callbacks_output_size"].asInt() < 0))
+    {
+        ssSetErrorStatus(S, "api_callbacks_output_size must be a non-negative integer.");
+        return;
+    }
+    const int api_callbacks_output_size = get_api_callbacks_output_size(param_json);
+    mexPrintf("API callbacks output port size: %d\n", api_callbacks_output_size);
+
+    std::vector<std::vector<int>> api_callbacks_output_shapes;
+    if (param_json.isMember("api_callbacks_outputs"))
+    {
+        for (const std::string &function_name : param_json["api_callbacks_outputs"].getMemberNames())
+        {
+            std::vector<int> shape;
+            if (!get_api_callbacks_output_shape(param_json["api_callbacks_outputs"][function_name], shape))
+            {
+                const std::string error_message = "API callback output: " + function_name + " must declare a shape of one or two positive integers.";
+                ssSetErrorStatus(S, error_message.c_str());
+                return;
+            }
+            api_callbacks_output_shapes.push_back(shape);
+            mexPrintf("API callback output port %zu: %s\n", api_callbacks_output_shapes.size() + 1, function_name.c_str());
+        }
+    }
+
+    // With an object or attribute port layout, port 0 only carries the time and each group has its own port
+    const std::vector<PortGroup> send_port_groups = get_port_groups(get_objects(param_json["send"]), param_json["send_order"], port_layout);
+    const std::vector<PortGroup> receive_port_groups = get_port_groups(get_objects(param_json["receive"]), param_json["receive_order"], port_layout);
+    if (port_layout != "vector")
+    {
+        input_port_size = 1;
+        output_port_size = 1;
+    }
+
+    if (!ssSetNumInputPorts(S, 1 + send_port_groups.size()))
         return;
-    ssSetInputPortWidth(S, 0, input_port_size);
+    if (is_batched)
+    {
+        ssSetInputPortMatrixDimensions(S, 0, world_count, input_port_size);
+    }
+    else
+    {
+        ssSetInputPortWidth(S, 0, input_port_size);
+    }
     ssSetInputPortDirectFeedThrough(S, 0, 1);
     ssSetInputPortDataType(S, 0, SS_DOUBLE);
+    for (size_t i = 0; i < send_port_groups.size(); i++)
+    {
+        // Send data is only read in mdlUpdate
+        const int_T port = 1 + i;
+        ssSetInputPortWidth(S, port, send_port_groups[i].size);
+        ssSetInputPortDirectFeedThrough(S, port, 0);
+        ssSetInputPortDataType(S, port, SS_DOUBLE);
+        mexPrintf("Send input port %d: %s\n", port, send_port_groups[i].name.c_str());
+    }
 
-    if (!ssSetNumOutputPorts(S, 2))
+    const OutputPorts output_ports = get_output_ports(api_callbacks_output_shapes.size(), typed_receive_ports.size(), param_json.get("reset_event", false).asBool(), param_json.get("diagnostics", false).asBool(), receive_port_groups.size());
+    if (!ssSetNumOutputPorts(S, output_ports.size))
         return;
-    ssSetOutputPortWidth(S, 0, output_port_size);
-    ssSetOutputPortWidth(S, 1, 10 * 10000);
+    if (is_batched)
+    {
+        ssSetOutputPortMatrixDimensions(S, 0, world_count, output_port_size);
+        mexPrintf("Batched worlds: %d\n", world_count);
+    }
+    else
+    {
+        ssSetOutputPortWidth(S, 0, output_port_size);
+    }
+    for (size_t i = 0; i < receive_port_groups.size(); i++)
+    {
+        const int_T port = output_ports.receive_groups_begin + i;
+        ssSetOutputPortWidth(S, port, receive_port_groups[i].size);
+        mexPrintf("Receive output port %d: %s\n", port, receive_port_groups[i].name.c_str());
+    }
+    ssSetOutputPortWidth(S, 1, api_callbacks_output_size);
+    if (api_callbacks_output_size > 0 && param_json.get("api_callbacks_output_variable_size", false).asBool())
+    {
+        // Only the valid prefix of the parsed response is propagated
+        ssSetOutputPortDimensionsMode(S, 1, VARIABLE_DIMS_MODE);
+        ssSetSignalSizesComputeType(S, SS_VARIABLE_SIZE_FROM_INPUT_VALUE_AND_SIZE);
+    }
+    for (size_t i = 0; i < api_callbacks_output_shapes.size(); i++)
+    {
+        const std::vector<int> &shape = api_callbacks_output_shapes[i];
+        if (shape.size() == 1)
+        {
+            ssSetOutputPortWidth(S, output_ports.api_callbacks_outputs_begin + i, shape[0]);
+        }
+        else
+        {
+            ssSetOutputPortMatrixDimensions(S, output_ports.api_callbacks_outputs_begin + i, shape[0], shape[1]);
+        }
+    }
+    // Image attributes such as [3, 640, 480] need N-D signals, which Simulink only allows when asked for
+    if (std::any_of(typed_receive_ports.begin(), typed_receive_ports.end(), [](const TypedPort &typed_port)
+                    { return typed_port.attribute.shape.size() > 2; }))
+    {
+        ssAllowSignalsWithMoreThan2D(S);
+    }
+    for (size_t i = 0; i < typed_receive_ports.size(); i++)
+    {
+        const int_T port = output_ports.typed_receive_begin + i;
+        const TypedPort &typed_port = typed_receive_ports[i];
+        std::vector<int_T> dims(typed_port.attribute.shape.begin(), typed_port.attribute.shape.end());
+        DECL_AND_INIT_DIMSINFO(dims_info);
+        dims_info.width = typed_port.attribute.size;
+        dims_info.numDims = dims.size();
+        dims_info.dims = dims.data();
+        ssSetOutputPortDimensionInfo(S, port, &dims_info);
+        ssSetOutputPortDataType(S, port, typed_port.attribute.data_type == "uint8" ? SS_UINT8 : SS_UINT16);
+        mexPrintf("Typed output port %d: %s:%s (%s)\n", port, typed_port.object_name.c_str(), typed_port.attribute_name.c_str(), typed_port.attribute.data_type.c_str());
+    }
+    if (output_ports.reset_event >= 0)
+    {
+        ssSetOutputPortWidth(S, output_ports.reset_event, world_count);
+        mexPrintf("Reset event output port %d\n", output_ports.reset_event);
+    }
+    if (output_ports.diagnostics >= 0)
+    {
+        if (is_batched)
+        {
+            ssSetOutputPortMatrixDimensions(S, output_ports.diagnostics, world_count, static_cast<int_T>(EDiagnostic::Size));
+        }
+        else
+        {
+            ssSetOutputPortWidth(S, output_ports.diagnostics, static_cast<int_T>(EDiagnostic::Size));
+        }
+        std::string diagnostics_str;
+        for (const char *diagnostic_name : diagnostic_names)
+        {
+            diagnostics_str += (diagnostics_str.empty() ? "" : ", ") + std::string(diagnostic_name);
+        }
+        mexPrintf("Diagnostics output port %d: [%s]\n", output_ports.diagnostics, diagnostics_str.c_str());
+    }
 
     ssSetNumSampleTimes(S, 1);
 
     /* Take care when specifying exception free code - see sfuntmpl.doc */
     ssSetOptions(S, SS_OPTION_EXCEPTION_FREE_CODE);
 
-    ssSetNumPWork(S, 1);
+    ssSetNumPWork(S, world_count);
 }
 #define MDL_START
 static void mdlStart(SimStruct *S)
@@ -585,25 +4442,132 @@ static void mdlStart(SimStruct *S)
     }
     const double time_step_value = mxGetPr(time_step)[0];
 
-    MultiverseConnector *mc = new MultiverseConnector(
-        host_str,
-        server_port_str,
-        client_port_str,
-        world_name_str,
-        simulation_name_str,
-        param_json,
-        time_step_value);
+    std::map<std::string, DeclaredAttribute> declared_attributes;
+    std::string declared_attributes_error;
+    if (!get_declared_attributes(param_json, declared_attributes, declared_attributes_error) || !check_custom_attributes(declared_attributes, declared_attributes_error))
+    {
+        ssSetErrorStatus(S, declared_attributes_error.c_str());
+        return;
+    }
+
+    std::set<std::string> block_client_ports;
+    for (const std::string &block_client_port : get_block_client_ports(param_json, client_port_str))
+    {
+        if (!block_client_ports.insert(block_client_port).second)
+        {
+            const std::string error_message = "Client port: " + block_client_port + " is used more than once by the block.";
+            ssSetErrorStatus(S, error_message.c_str());
+            return;
+        }
+        if (client_ports_in_use.count(block_client_port) != 0)
+        {
+            const std::string error_message = "Client port: " + block_client_port + " is already used by another block.";
+            ssSetErrorStatus(S, error_message.c_str());
+            return;
+        }
+    }
+    if (!param_json.isMember("worlds"))
+    {
+        MultiverseConnector *mc = new MultiverseConnector(
+            host_str,
+            server_port_str,
+            client_port_str,
+            world_name_str,
+            simulation_name_str,
+            param_json,
+            time_step_value);
+
+        mc->start();
+
+        // Save in work state
+        ssSetPWorkValue(S, 0, mc);
+        return;
+    }
+
+    // Each batched world gets its own connector, client port and communicate thread, so the round trips run concurrently
+    for (int_T world = 0; world < ssGetNumPWork(S); world++)
+    {
+        MultiverseConnector *mc = new MultiverseConnector(
+            host_str,
+            server_port_str,
+            param_json["client_ports"][world].asString(),
+            param_json["worlds"][world].asString(),
+            simulation_name_str,
+            param_json,
+            time_step_value);
 
-    mc->start();
+        mc->start();
 
-    // Save in work state
-    ssSetPWorkValue(S, 0, mc);
+        ssSetPWorkValue(S, world, mc);
+    }
 }
 static void mdlInitializeSampleTimes(SimStruct *S) /* Set the sample time of the S-function as inherited */
 {
     ssSetSampleTime(S, 0, INHERITED_SAMPLE_TIME);
     ssSetOffsetTime(S, 0, 0.0);
 }
+/**
+ * Slice world_time onto output port 0 and the receive data onto the receive group ports, in port order
+ */
+static void write_receive_groups(SimStruct *S, const OutputPorts &output_ports, const std::vector<double> &receive_ports_data)
+{
+    ssGetOutputPortRealSignal(S, 0)[0] = receive_ports_data[0];
+    std::vector<double>::const_iterator receive_data = receive_ports_data.begin() + 1;
+    for (int_T port = output_ports.receive_groups_begin; port < output_ports.size; port++)
+    {
+        const int_T width = ssGetOutputPortWidth(S, port);
+        std::copy(receive_data, receive_data + width, ssGetOutputPortRealSignal(S, port));
+        receive_data += width;
+    }
+}
+/**
+ * Write the receive data, reset events and diagnostics of each batched world to its row of the output ports
+ */
+static void write_batched_outputs(SimStruct *S)
+{
+    const int_T world_count = ssGetNumPWork(S);
+    const bool is_major_time_step = ssIsMajorTimeStep(S);
+    InputRealPtrsType input_ptrs = ssGetInputPortRealSignalPtrs(S, 0);
+    real_T *output_ptrs = ssGetOutputPortRealSignal(S, 0);
+    const size_t output_width = ssGetOutputPortWidth(S, 0) / world_count;
+    for (int_T world = 0; world < world_count; world++)
+    {
+        MultiverseConnector *mc = static_cast<MultiverseConnector *>(ssGetPWorkValue(S, world));
+        const OutputPorts &output_ports = mc->get_output_ports();
+        if (is_major_time_step)
+        {
+            const bool has_reset_event = mc->has_reset_event();
+            mc->set_evaluation_time(*input_ptrs[world]);
+            mc->pace(*input_ptrs[world]);
+            if (!mc->check_receive_deadline())
+            {
+                ssSetErrorStatus(S, "Receive timeout: too many consecutive steps missed the receive deadline.");
+                return;
+            }
+            if (output_ports.reset_event >= 0)
+            {
+                ssGetOutputPortRealSignal(S, output_ports.reset_event)[world] = has_reset_event ? 1.0 : 0.0;
+            }
+            if (output_ports.diagnostics >= 0)
+            {
+                std::array<double, static_cast<size_t>(EDiagnostic::Size)> diagnostics;
+                mc->get_diagnostics(diagnostics.data());
+                real_T *diagnostics_ptrs = ssGetOutputPortRealSignal(S, output_ports.diagnostics);
+                for (size_t i = 0; i < diagnostics.size(); i++)
+                {
+                    diagnostics_ptrs[world + i * world_count] = diagnostics[i];
+                }
+            }
+        }
+
+        // Matrix ports are column-major, a row is strided by the world count
+        const std::vector<double> &receive_ports_data = mc->get_receive_ports_data(is_major_time_step);
+        for (size_t i = 0; i < std::min(output_width, receive_ports_data.size()); i++)
+        {
+            output_ptrs[world + i * world_count] = receive_ports_data[i];
+        }
+    }
+}
 static void mdlOutputs(SimStruct *S, int_T tid) /* Calculate the block output for each time step */
 {
     MultiverseConnector *mc = static_cast<MultiverseConnector *>(ssGetPWorkValue(S, 0));
@@ -612,21 +4576,71 @@ static void mdlOutputs(SimStruct *S, int_T tid) /* Calculate the block output fo
         ssSetErrorStatus(S, "MultiverseConnector is null !!!");
         return;
     }
-    int_T i;
+    if (ssGetNumPWork(S) > 1)
+    {
+        write_batched_outputs(S);
+        return;
+    }
+    real_T *output_1_ptrs = ssGetOutputPortRealSignal(S, 0);
+    const OutputPorts &output_ports = mc->get_output_ports();
+    if (!ssIsMajorTimeStep(S))
+    {
+        // Minor time steps of variable-step solvers read the snapshot of the last major time step
+        if (output_ports.receive_groups_begin < output_ports.size)
+        {
+            write_receive_groups(S, output_ports, mc->get_receive_ports_data(false));
+            return;
+        }
+        mc->get_receive_data_snapshot(output_1_ptrs, ssGetOutputPortWidth(S, 0));
+        return;
+    }
     InputRealPtrsType input_ptrs = ssGetInputPortRealSignalPtrs(S, 0);
-    mc->set_sim_time(*input_ptrs[0]);
-    for (i = 0; i < mc->get_send_data_size(); i++)
+    const bool has_reset_event = mc->has_reset_event();
+    mc->set_evaluation_time(*input_ptrs[0]);
+    mc->pace(*input_ptrs[0]);
+    if (!mc->check_receive_deadline())
+    {
+        ssSetErrorStatus(S, "Receive timeout: too many consecutive steps missed the receive deadline.");
+        return;
+    }
+    if (output_ports.receive_groups_begin < output_ports.size)
     {
-        mc->set_send_data_at(i, *input_ptrs[i + 1]);
+        write_receive_groups(S, output_ports, mc->get_receive_ports_data(true));
+    }
+    else
+    {
+        mc->get_receive_data(output_1_ptrs, ssGetOutputPortWidth(S, 0));
     }
 
-    real_T *output_1_ptrs = ssGetOutputPortRealSignal(S, 0);
-    output_1_ptrs[0] = mc->get_world_time();
-    for (i = 0; i < mc->get_receive_data_size(); i++)
+    for (int_T port = output_ports.typed_receive_begin; port < output_ports.typed_receive_begin + static_cast<int_T>(mc->get_typed_receive_ports_size()); port++)
+    {
+        mc->get_typed_receive_data(port - output_ports.typed_receive_begin, ssGetOutputPortSignal(S, port));
+    }
+
+    if (output_ports.reset_event >= 0)
+    {
+        ssGetOutputPortRealSignal(S, output_ports.reset_event)[0] = has_reset_event ? 1.0 : 0.0;
+    }
+
+    if (output_ports.diagnostics >= 0)
+    {
+        mc->get_diagnostics(ssGetOutputPortRealSignal(S, output_ports.diagnostics));
+    }
+
+    if (output_ports.typed_receive_begin > output_ports.api_callbacks_outputs_begin)
     {
-        output_1_ptrs[i + 1] = mc->get_receive_data_at(i);
+        std::vector<double *> api_callbacks_output_ptrs;
+        for (int_T port = output_ports.api_callbacks_outputs_begin; port < output_ports.typed_receive_begin; port++)
+        {
+            api_callbacks_output_ptrs.push_back(ssGetOutputPortRealSignal(S, port));
+        }
+        mc->read_api_callbacks_outputs(api_callbacks_output_ptrs);
     }
 
+    if (ssGetOutputPortWidth(S, 1) == 0 || mc->has_api_callbacks_output("get_everything"))
+    {
+        return;
+    }
     const Json::Value api_callbacks_response = mc->get_api_callbacks_response();
     if (!api_callbacks_response.empty())
     {
@@ -677,22 +4691,70 @@ static void mdlOutputs(SimStruct *S, int_T tid) /* Calculate the block output fo
                             }
                             output_2_ptrs[idx++] = std::stod(it->str());
                         }
+                        if (ssGetOutputPortDimensionsMode(S, 1) == VARIABLE_DIMS_MODE)
+                        {
+                            ssSetCurrentOutputPortDimensions(S, 1, 0, idx);
+                        }
                     }
                 }
             }
         }
     }
 }
-static void mdlTerminate(SimStruct *S)
+#define MDL_UPDATE
+static void mdlUpdate(SimStruct *S, int_T tid) /* Publish the send data once per major time step */
 {
     MultiverseConnector *mc = static_cast<MultiverseConnector *>(ssGetPWorkValue(S, 0));
-    if (mc != nullptr)
+    if (mc == nullptr)
+    {
+        return;
+    }
+    InputRealPtrsType input_ptrs = ssGetInputPortRealSignalPtrs(S, 0);
+    const int_T world_count = ssGetNumPWork(S);
+    if (world_count > 1)
+    {
+        const int_T input_width = ssGetInputPortWidth(S, 0) / world_count;
+        for (int_T world = 0; world < world_count; world++)
+        {
+            MultiverseConnector *world_mc = static_cast<MultiverseConnector *>(ssGetPWorkValue(S, world));
+            std::vector<const double *> &send_ports_ptrs = world_mc->get_send_ports_ptrs();
+            send_ports_ptrs.clear();
+            for (int_T i = 1; i < input_width; i++)
+            {
+                send_ports_ptrs.push_back(input_ptrs[world + i * world_count]);
+            }
+            world_mc->set_send_data(*input_ptrs[world], send_ports_ptrs.data(), send_ports_ptrs.size());
+        }
+        return;
+    }
+    if (ssGetNumInputPorts(S) == 1)
+    {
+        mc->set_send_data(*input_ptrs[0], input_ptrs + 1, ssGetInputPortWidth(S, 0) - 1);
+        return;
+    }
+    std::vector<const double *> &send_ports_ptrs = mc->get_send_ports_ptrs();
+    send_ports_ptrs.clear();
+    for (int_T port = 1; port < ssGetNumInputPorts(S); port++)
     {
-        mexPrintf("Terminating MultiverseConnector...\n");
-        mc->stop();
-        delete mc;
-        mc = nullptr;
-        mexPrintf("MultiverseConnector terminated.\n");
+        InputRealPtrsType port_ptrs = ssGetInputPortRealSignalPtrs(S, port);
+        send_ports_ptrs.insert(send_ports_ptrs.end(), port_ptrs, port_ptrs + ssGetInputPortWidth(S, port));
+    }
+    mc->set_send_data(*input_ptrs[0], send_ports_ptrs.data(), send_ports_ptrs.size());
+}
+
+static void mdlTerminate(SimStruct *S)
+{
+    for (int_T world = 0; world < ssGetNumPWork(S); world++)
+    {
+        MultiverseConnector *mc = static_cast<MultiverseConnector *>(ssGetPWorkValue(S, world));
+        if (mc != nullptr)
+        {
+            mexPrintf("Terminating MultiverseConnector...\n");
+            mc->stop();
+            delete mc;
+            ssSetPWorkValue(S, world, nullptr);
+            mexPrintf("MultiverseConnector terminated.\n");
+        }
     }
 } /* Perform tasks at the end of the simulation */
 